@@ -15,7 +15,9 @@
 #define HEADER_SIZE    6
 #define CAN_ID_SIZE    4
 #define MAX_DATA_BYTES 8
-#define MAX_MSG_BYTES  22
+// Every byte after the size byte may be escaped, so an encoded message is 
+// at most the start and size bytes plus twice the identifier and data
+#define MAX_MSG_BYTES  26
 
 // API Classes
 #define API_SYS      0
@@ -25,6 +27,7 @@
 #define API_POSITION 3
 #define API_CURRENT  4
 #define API_STATUS   5
+#define API_PSTAT    6
 #define API_CONFIG   7
 #define API_ACK      8
 
@@ -112,6 +115,55 @@
 #define STATUS_MODE_POSITION 3
 #define STATUS_MODE_VOLTCOMP 4
 
+// Periodic Status Interface
+#define PSTAT_MESSAGES  4
+#define PSTAT_PER_EN_S0 0
+#define PSTAT_PER_EN_S1 1
+#define PSTAT_PER_EN_S2 2
+#define PSTAT_PER_EN_S3 3
+#define PSTAT_CFG_S0    4
+#define PSTAT_CFG_S1    5
+#define PSTAT_CFG_S2    6
+#define PSTAT_CFG_S3    7
+#define PSTAT_DATA_S0   8
+#define PSTAT_DATA_S1   9
+#define PSTAT_DATA_S2   10
+#define PSTAT_DATA_S3   11
+
+// Periodic status message layout, one code per data byte
+#define PSTAT_END                0
+#define PSTAT_VOLTOUT_B0         1
+#define PSTAT_VOLTOUT_B1         2
+#define PSTAT_VOLTBUS_B0         3
+#define PSTAT_VOLTBUS_B1         4
+#define PSTAT_CURRENT_B0         5
+#define PSTAT_CURRENT_B1         6
+#define PSTAT_TEMP_B0            7
+#define PSTAT_TEMP_B1            8
+#define PSTAT_POS_B0             9
+#define PSTAT_POS_B1             10
+#define PSTAT_POS_B2             11
+#define PSTAT_POS_B3             12
+#define PSTAT_SPD_B0             13
+#define PSTAT_SPD_B1             14
+#define PSTAT_SPD_B2             15
+#define PSTAT_SPD_B3             16
+#define PSTAT_LIMIT_NCLR         17
+#define PSTAT_LIMIT_CLR          18
+#define PSTAT_FAULT              19
+#define PSTAT_STKY_FLT_NCLR      20
+#define PSTAT_STKY_FLT_CLR       21
+#define PSTAT_VOUT_B0            22
+#define PSTAT_VOUT_B1            23
+#define PSTAT_FLT_COUNT_CURRENT  24
+#define PSTAT_FLT_COUNT_TEMP     25
+#define PSTAT_FLT_COUNT_VOLTBUS  26
+#define PSTAT_FLT_COUNT_GATE     27
+#define PSTAT_FLT_COUNT_COMM     28
+#define PSTAT_CANSTS             29
+#define PSTAT_CANERR_B0          30
+#define PSTAT_CANERR_B1          31
+
 // Motor Control Configuration
 #define CONFIG_BRUSHES       0
 #define CONFIG_ENCODER_LINES 1
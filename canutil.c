@@ -1,112 +1,592 @@
 #include "can.h"
 #include "canutil.h"
 
-int encode_can_message(CANMessage *message, CANEncodedMsg *encoded_message)
+#include <string.h>
+
+// Bytes after the size byte, all of which are subject to escaping
+#define PAYLOAD_BYTES (CAN_ID_SIZE + MAX_DATA_BYTES)
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static inline uint64_t load64(const uint8_t *bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Mask selecting the first count bytes, 0 to 8, of a word loaded from memory
+static inline uint64_t first_bytes(int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return ~0ULL << (64 - 8 * count);
+#else
+    return ~0ULL >> (64 - 8 * count);
+#endif
+}
+
+// Nonzero if any selected byte of a word is START_OF_FRAME or ENCODE_BYTE_A,
+// checking eight bytes at a time. Both special bytes become zero when the 
+// low bit is set and the word inverted.
+static inline uint64_t special_bytes(uint64_t word, uint64_t mask)
 {
+    uint64_t v;
+
+    v = ~((word & mask) | ONES);
+    return (v - ONES) & ~v & HIGHS;
+}
+
+// Decode one frame starting at a start of frame byte. Returns PARSE_FRAME 
+// and the raw frame size, PARSE_NEED_MORE if the frame runs past the 
+// available bytes, or PARSE_ERROR.
+static inline int decode_frame(const uint8_t *frame, size_t available, 
+        CANMessage *message, size_t *frame_size)
+{
+    uint8_t payload[PAYLOAD_BYTES];
+    const uint8_t *raw;
+    const uint8_t *end;
+    const uint8_t *bytes;
+    uint64_t data;
+    uint8_t count;
+    uint8_t byte;
     int i;
-    uint8_t size;
-    uint8_t *can_id;
-    uint8_t *data_ptr;
 
-    size = HEADER_SIZE + message->data_size;
+    if (available < 2) {
+        return PARSE_NEED_MORE;
+    }
+    count = frame[1];
+    if (count < CAN_ID_SIZE || count > PAYLOAD_BYTES) {
+        return PARSE_ERROR;
+    }
 
-    // Set start of frame byte
-    encoded_message->data[0] = (uint8_t) START_OF_FRAME;
+    raw = &frame[2];
+    bytes = payload;
+    i = 0;
+    if (available >= 2 + PAYLOAD_BYTES
+            && !special_bytes(load64(raw), first_bytes(CAN_ID_SIZE))) {
+        if (!special_bytes(load64(raw + CAN_ID_SIZE), 
+                first_bytes(count - CAN_ID_SIZE))) {
+            // No escapes, the payload is the raw bytes
+            bytes = raw;
+            i = count;
+        } else {
+            // Only the data needs decoding
+            memcpy(payload, raw, CAN_ID_SIZE);
+            i = CAN_ID_SIZE;
+        }
+        raw += i;
+    }
 
-    // Set packet size byte
-    encoded_message->data[1] = (uint8_t) (CAN_ID_SIZE + message->data_size);
+    end = frame + available;
+    for (; i < count; i++) {
+        if (raw >= end) {
+            return PARSE_NEED_MORE;
+        }
+        byte = *raw;
+        raw += 1;
+        if (byte == ENCODE_BYTE_A) {
+            if (raw >= end) {
+                return PARSE_NEED_MORE;
+            }
+            // ENCODE_BYTE_A pairs decode to one more than their second byte
+            byte = *raw;
+            raw += 1;
+            if (byte != ENCODE_BYTE_A && byte != ENCODE_BYTE_B) {
+                return PARSE_ERROR;
+            }
+            byte += 1;
+        } else if (byte == START_OF_FRAME) {
+            return PARSE_ERROR;
+        }
+        payload[i] = byte;
+    }
+
+    message->device = bytes[0] & 0x3F;
+    message->api_index = (bytes[0] >> 6) | ((bytes[1] & 0x03) << 2);
+    message->api_class = bytes[1] >> 2;
+    message->manufacturer = bytes[2];
+    message->device_type = bytes[3];
+    message->data_size = (uint8_t) (count - CAN_ID_SIZE);
+
+    // Copy a whole word of data and clear the bytes past the end, so the 
+    // copy does not depend on the data size
+    data = load64(&bytes[CAN_ID_SIZE]) & first_bytes(message->data_size);
+    memcpy(message->data, &data, sizeof(data));
+
+    *frame_size = (size_t) (raw - frame);
+    return PARSE_FRAME;
+}
+
+// Append a byte, escaping START_OF_FRAME and ENCODE_BYTE_A as ENCODE_BYTE_A 
+// followed by the byte minus one
+static inline uint8_t *put_byte(uint8_t *out, uint8_t byte)
+{
+    if ((byte | 1) == START_OF_FRAME) {
+        out[0] = (uint8_t) ENCODE_BYTE_A;
+        out[1] = (uint8_t) (byte - 1);
+        return out + 2;
+    }
+    out[0] = byte;
+    return out + 1;
+}
+
+// Encode a frame straight into a buffer with room for MAX_MSG_BYTES, such 
+// as a transmit ring. size is set to the number of bytes used.
+int encode_can_bytes(CANMessage *message, uint8_t *buffer, size_t *size)
+{
+    uint8_t can_id[sizeof(uint64_t)];
+    uint8_t *out;
+    uint64_t data;
+    int i;
+
+    if (message->data_size > MAX_DATA_BYTES) {
+        return 1;
+    }
+
+    // Set start of frame and packet size bytes
+    buffer[0] = (uint8_t) START_OF_FRAME;
+    buffer[1] = (uint8_t) (CAN_ID_SIZE + message->data_size);
 
     // Set CAN identifier
-    can_id = &(encoded_message->data[2]);
-    can_id[0] = message->device;
-    can_id[0] |= message->api_index << 6;
-    can_id[1] = message->api_index >> 2;
-    can_id[1] |= message->api_class << 2;
+    memset(can_id, 0, sizeof(can_id));
+    can_id[0] = message->device | message->api_index << 6;
+    can_id[1] = message->api_index >> 2 | message->api_class << 2;
     can_id[2] = message->manufacturer;
     can_id[3] = message->device_type;
 
-    // Set data bytes
-    data_ptr = &(encoded_message->data[HEADER_SIZE]);
-    for (i = 0; i < message->data_size; i++) {
-        // Encode special bytes
-        if (message->data[i] == START_OF_FRAME) {
-            *data_ptr = (uint8_t) ENCODE_BYTE_A;
-            data_ptr += 1;
-            *data_ptr = (uint8_t) ENCODE_BYTE_A;
-            data_ptr += 1;
-            size += 1;
-        } else if (message->data[i] == ENCODE_BYTE_A) {
-            *data_ptr = (uint8_t) ENCODE_BYTE_A;
-            data_ptr += 1;
-            *data_ptr = (uint8_t) ENCODE_BYTE_B;
-            data_ptr += 1;
-            size += 1;
+    out = &buffer[2];
+    data = load64(message->data) & first_bytes(message->data_size);
+    if (!(special_bytes(load64(can_id), first_bytes(CAN_ID_SIZE)) 
+            | special_bytes(data, ~0ULL))) {
+        // Common case, nothing to escape, store whole words
+        memcpy(out, can_id, CAN_ID_SIZE);
+        memcpy(out + CAN_ID_SIZE, &data, sizeof(data));
+        out += CAN_ID_SIZE + message->data_size;
+    } else {
+        if (special_bytes(load64(can_id), first_bytes(CAN_ID_SIZE))) {
+            for (i = 0; i < CAN_ID_SIZE; i++) {
+                out = put_byte(out, can_id[i]);
+            }
         } else {
-            // Not a special byte, copy data
-            *data_ptr = message->data[i];
-            data_ptr += 1;
+            memcpy(out, can_id, CAN_ID_SIZE);
+            out += CAN_ID_SIZE;
+        }
+        for (i = 0; i < message->data_size; i++) {
+            out = put_byte(out, message->data[i]);
         }
     }
 
-    encoded_message->size = size;
+    *size = (size_t) (out - buffer);
+
+    return 0;
+}
+
+int encode_can_message(CANMessage *message, CANEncodedMsg *encoded_message)
+{
+    size_t size;
+
+    if (encode_can_bytes(message, encoded_message->data, &size)) {
+        return 1;
+    }
+    encoded_message->size = (uint8_t) size;
 
     return 0;
 }
 
 int decode_can_message(CANEncodedMsg *encoded_message, CANMessage *message)
 {
+    size_t frame_size;
+
+    if (decode_frame(encoded_message->data, MAX_MSG_BYTES, message, 
+            &frame_size) != PARSE_FRAME) {
+        // Decoding error
+        return 1;
+    }
+
+    return 0;
+}
+
+// Encode messages back to back into one buffer. Returns the number of 
+// messages that fit, used is set to the number of bytes written.
+int encode_can_messages(CANMessage *messages, int count, uint8_t *buffer, 
+        size_t size, size_t *used)
+{
+    CANEncodedMsg encoded_message;
+    size_t frame_size;
+    size_t offset;
     int i;
-    uint8_t *can_id;
-    uint8_t *data_ptr;
-    
-    // Get packet size
-    message->data_size = (uint8_t) (encoded_message->data[1] - CAN_ID_SIZE);
-
-    // Get CAN identifier
-    can_id = &(encoded_message->data[2]);
-    message->device = can_id[0] & 0x3F;
-    message->api_index = (can_id[0] >> 6) | ((can_id[1] & 0x03) << 2);
-    message->api_class = can_id[1] >> 2;
-    message->manufacturer = can_id[2];
-    message->device_type = can_id[3];
-    
-    // Get data bytes
-    data_ptr = &(encoded_message->data[HEADER_SIZE]);
-    for (i = 0; i < message->data_size; i++) {
-        // Decode special bytes
-        if (*data_ptr == ENCODE_BYTE_A) {
-            data_ptr += 1;
-            if (*data_ptr == ENCODE_BYTE_A) {
-                message->data[i] = (uint8_t) START_OF_FRAME;
-                data_ptr += 1;
-            } else if (*data_ptr == ENCODE_BYTE_B) {
-                message->data[i] = (uint8_t) ENCODE_BYTE_A;
-                data_ptr += 1;
-            } else {
-                // Decoding error
-                return 1;
+
+    offset = 0;
+    for (i = 0; i < count; i++) {
+        if (offset + MAX_MSG_BYTES <= size) {
+            // Room for any frame, encode in place
+            if (encode_can_bytes(&messages[i], &buffer[offset], 
+                    &frame_size)) {
+                break;
             }
-        } else {
-            message->data[i] = *data_ptr;
-            data_ptr += 1;
+            offset += frame_size;
+            continue;
+        }
+        if (encode_can_message(&messages[i], &encoded_message)) {
+            break;
+        }
+        if (offset + encoded_message.size > size) {
+            break;
         }
+        memcpy(&buffer[offset], encoded_message.data, encoded_message.size);
+        offset += encoded_message.size;
     }
 
+    *used = offset;
+    return i;
+}
+
+// Decode every complete frame in a buffer. Returns the number of messages 
+// decoded, consumed is set to the start of the first incomplete frame and 
+// errors to the number of damaged frames skipped.
+int decode_can_messages(const uint8_t *buffer, size_t size, 
+        CANMessage *messages, int max_messages, size_t *consumed, 
+        int *errors)
+{
+    const uint8_t *frame;
+    size_t offset;
+    size_t frame_size;
+    int count;
+    int result;
+
+    count = 0;
+    offset = 0;
+    *errors = 0;
+    while (count < max_messages && offset < size) {
+        // Frames are usually back to back
+        frame = &buffer[offset];
+        if (*frame != START_OF_FRAME) {
+            frame = memchr(frame, START_OF_FRAME, size - offset);
+            if (frame == NULL) {
+                offset = size;
+                break;
+            }
+        }
+        offset = (size_t) (frame - buffer);
+
+        result = decode_frame(frame, size - offset, &messages[count], 
+                &frame_size);
+        if (result == PARSE_NEED_MORE) {
+            break;
+        }
+        if (result == PARSE_ERROR) {
+            *errors += 1;
+            offset += 1;
+            continue;
+        }
+        offset += frame_size;
+        count += 1;
+    }
+
+    *consumed = offset;
+    return count;
+}
+
+// Pack the fields of a message into the 29-bit CAN identifier, using the 
+// same layout as the identifier bytes of an encoded message
+uint32_t can_message_id(CANMessage *message)
+{
+    return (uint32_t) (message->device & 0x3F)
+            | (uint32_t) (message->api_index & 0x0F) << 6
+            | (uint32_t) (message->api_class & 0x3F) << 10
+            | (uint32_t) message->manufacturer << 16
+            | (uint32_t) (message->device_type & 0x1F) << 24;
+}
+
+// Inverse of can_message_id(), fill in the fields of a 29-bit identifier
+int set_can_message_id(CANMessage *message, uint32_t id)
+{
+    message->device = (uint8_t) (id & 0x3F);
+    message->api_index = (uint8_t) ((id >> 6) & 0x0F);
+    message->api_class = (uint8_t) ((id >> 10) & 0x3F);
+    message->manufacturer = (uint8_t) (id >> 16);
+    message->device_type = (uint8_t) ((id >> 24) & 0x1F);
+    return 0;
+}
+
+int init_frame_parser(CANFrameParser *parser)
+{
+    parser->state = PARSE_SEEK_START;
+    parser->remaining = 0;
+    parser->frame.size = 0;
     return 0;
 }
 
+int parse_can_bytes(CANFrameParser *parser, const uint8_t *bytes, size_t size,
+        size_t *consumed, CANMessage *message)
+{
+    size_t i;
+    size_t frame_size;
+    uint8_t byte;
+    const uint8_t *start;
+    CANEncodedMsg *frame;
+
+    frame = &(parser->frame);
+
+    for (i = 0; i < size; i++) {
+        byte = bytes[i];
+
+        // Between frames, skip to the next start of frame and decode the 
+        // frame in place when all of it is in this chunk
+        if (parser->state == PARSE_SEEK_START) {
+            start = &bytes[i];
+            if (byte != START_OF_FRAME) {
+                start = memchr(start, START_OF_FRAME, size - i);
+                if (start == NULL) {
+                    break;
+                }
+            }
+            i = (size_t) (start - bytes);
+            if (decode_frame(start, size - i, message, &frame_size) 
+                    == PARSE_FRAME) {
+                *consumed = i + frame_size;
+                return PARSE_FRAME;
+            }
+            byte = START_OF_FRAME;
+        }
+
+        // An unencoded start of frame byte always begins a new frame
+        if (byte == START_OF_FRAME) {
+            frame->data[0] = START_OF_FRAME;
+            frame->size = 1;
+            if (parser->state != PARSE_SEEK_START) {
+                // Previous frame was cut short
+                parser->state = PARSE_SIZE;
+                *consumed = i + 1;
+                return PARSE_ERROR;
+            }
+            parser->state = PARSE_SIZE;
+            continue;
+        }
+
+        switch (parser->state) {
+        case PARSE_SEEK_START:
+            // Discard bytes until start of frame
+            break;
+        case PARSE_SIZE:
+            if (byte < CAN_ID_SIZE || byte > CAN_ID_SIZE + MAX_DATA_BYTES) {
+                parser->state = PARSE_SEEK_START;
+                *consumed = i + 1;
+                return PARSE_ERROR;
+            }
+            frame->data[1] = byte;
+            frame->size = 2;
+            parser->remaining = byte;
+            parser->state = PARSE_BODY;
+            break;
+        case PARSE_BODY:
+            if (frame->size >= MAX_MSG_BYTES) {
+                parser->state = PARSE_SEEK_START;
+                *consumed = i + 1;
+                return PARSE_ERROR;
+            }
+            frame->data[frame->size] = byte;
+            frame->size += 1;
+            if (byte == ENCODE_BYTE_A) {
+                // Wait for the second encoded byte
+                parser->state = PARSE_ESCAPE;
+                break;
+            }
+            parser->remaining -= 1;
+            break;
+        case PARSE_ESCAPE:
+            if ((byte != ENCODE_BYTE_A && byte != ENCODE_BYTE_B)
+                    || frame->size >= MAX_MSG_BYTES) {
+                parser->state = PARSE_SEEK_START;
+                *consumed = i + 1;
+                return PARSE_ERROR;
+            }
+            frame->data[frame->size] = byte;
+            frame->size += 1;
+            parser->remaining -= 1;
+            parser->state = PARSE_BODY;
+            break;
+        }
+
+        if (parser->state == PARSE_BODY && parser->remaining == 0) {
+            parser->state = PARSE_SEEK_START;
+            *consumed = i + 1;
+            if (decode_can_message(frame, message)) {
+                return PARSE_ERROR;
+            }
+            return PARSE_FRAME;
+        }
+    }
+
+    *consumed = size;
+    return PARSE_NEED_MORE;
+}
+
+// Scale factors of the controllers' fixed point formats, powers of two so 
+// converting to floating point is exact apart from rounding to float
+#define FIXED16_ONE 256.0
+#define FIXED32_ONE 65536.0
+
 float fixed16_to_float(uint16_t fx)
 {
-    float fl;
-    fl = (float) (fx >> 8);
-    fl += (float) (fx & 0x00ff) / 256.0;
-    return fl;
+    return (float) fx * (float) (1.0 / FIXED16_ONE);
 }
 
 float fixed32_to_float(uint32_t fx)
 {
-    float fl;
-    fl = (float) (fx >> 16);
-    fl += (float) (fx & 0x0000ffff) / 65536.0;
-    return fl;
+    return (float) fx * (float) (1.0 / FIXED32_ONE);
+}
+
+// Adding and subtracting 1.5 * 2^52 rounds a double to the nearest 
+// integer, ties to even, without a branch or a libm call
+#define ROUND_MAGIC 6755399441055744.0
+
+// Round an already scaled value and clamp it to [min, max], NaN becomes 0. 
+// Kept to selects so the loops below vectorize.
+static inline double round_fixed(double x, double min, double max)
+{
+    x = (x + ROUND_MAGIC) - ROUND_MAGIC;
+    x = x < min ? min : x;
+    x = x > max ? max : x;
+    return x != x ? 0.0 : x;
+}
+
+int16_t double_to_fixed16(double value)
+{
+    return (int16_t) round_fixed(value * FIXED16_ONE, INT16_MIN, INT16_MAX);
+}
+
+int32_t double_to_fixed32(double value)
+{
+    return (int32_t) round_fixed(value * FIXED32_ONE, INT32_MIN, INT32_MAX);
+}
+
+// Batch conversions between arrays of signed 8.8 or 16.16 fixed point and 
+// floating point. Conversions to fixed point round to nearest and saturate, 
+// and return how many results ended up at a limit of the range, which 
+// includes every value that saturated. Counting is a second pass over the 
+// results so the conversion loop stays vectorizable.
+
+int fixed16_to_floats(const int16_t *fx, float *values, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        values[i] = (float) fx[i] * (float) (1.0 / FIXED16_ONE);
+    }
+
+    return 0;
+}
+
+int fixed16_to_doubles(const int16_t *fx, double *values, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        values[i] = (double) fx[i] * (1.0 / FIXED16_ONE);
+    }
+
+    return 0;
+}
+
+int fixed32_to_floats(const int32_t *fx, float *values, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        values[i] = (float) fx[i] * (float) (1.0 / FIXED32_ONE);
+    }
+
+    return 0;
+}
+
+int fixed32_to_doubles(const int32_t *fx, double *values, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        values[i] = (double) fx[i] * (1.0 / FIXED32_ONE);
+    }
+
+    return 0;
+}
+
+static int count_limits16(const int16_t *fx, size_t count)
+{
+    int limits;
+    size_t i;
+
+    limits = 0;
+    for (i = 0; i < count; i++) {
+        limits += fx[i] == INT16_MIN || fx[i] == INT16_MAX;
+    }
+
+    return limits;
+}
+
+static int count_limits32(const int32_t *fx, size_t count)
+{
+    int limits;
+    size_t i;
+
+    limits = 0;
+    for (i = 0; i < count; i++) {
+        limits += fx[i] == INT32_MIN || fx[i] == INT32_MAX;
+    }
+
+    return limits;
+}
+
+// Floats are widened to double first, which is exact, so they round the 
+// same way doubles do
+int floats_to_fixed16(const float *values, int16_t *fx, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        fx[i] = (int16_t) round_fixed((double) values[i] * FIXED16_ONE, 
+                INT16_MIN, INT16_MAX);
+    }
+
+    return count_limits16(fx, count);
+}
+
+int doubles_to_fixed16(const double *values, int16_t *fx, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        fx[i] = (int16_t) round_fixed(values[i] * FIXED16_ONE, INT16_MIN, 
+                INT16_MAX);
+    }
+
+    return count_limits16(fx, count);
+}
+
+int floats_to_fixed32(const float *values, int32_t *fx, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        fx[i] = (int32_t) round_fixed((double) values[i] * FIXED32_ONE, 
+                INT32_MIN, INT32_MAX);
+    }
+
+    return count_limits32(fx, count);
+}
+
+int doubles_to_fixed32(const double *values, int32_t *fx, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        fx[i] = (int32_t) round_fixed(values[i] * FIXED32_ONE, INT32_MIN, 
+                INT32_MAX);
+    }
+
+    return count_limits32(fx, count);
 }
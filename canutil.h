@@ -1,12 +1,67 @@
 #include "can.h"
 
+#include <stddef.h>
+
 #ifndef CANUTIL_H
 #define CANUTIL_H
 
+// Frame parser states
+#define PARSE_SEEK_START 0
+#define PARSE_SIZE       1
+#define PARSE_BODY       2
+#define PARSE_ESCAPE     3
+
+// Frame parser results
+#define PARSE_NEED_MORE 0
+#define PARSE_FRAME     1
+#define PARSE_ERROR     2
+
+// Incremental parser for serial frames. Bytes may be fed in chunks of any
+// size; a frame split across chunks is resumed on the next call.
+typedef struct CANFrameParser {
+    uint8_t state;
+    uint8_t remaining;
+    CANEncodedMsg frame;
+} CANFrameParser;
+
 int encode_can_message(CANMessage *message, CANEncodedMsg *encoded_message);
+int encode_can_bytes(CANMessage *message, uint8_t *buffer, size_t *size);
 int decode_can_message(CANEncodedMsg *encoded_message, CANMessage *message);
+int encode_can_messages(CANMessage *messages, int count, uint8_t *buffer, 
+        size_t size, size_t *used);
+int decode_can_messages(const uint8_t *buffer, size_t size, 
+        CANMessage *messages, int max_messages, size_t *consumed, 
+        int *errors);
 
+uint32_t can_message_id(CANMessage *message);
+int set_can_message_id(CANMessage *message, uint32_t id);
+
+int init_frame_parser(CANFrameParser *parser);
+int parse_can_bytes(CANFrameParser *parser, const uint8_t *bytes, size_t size,
+        size_t *consumed, CANMessage *message);
+
+// Unsigned 8.8 and 16.16 fixed point, for values that are never negative 
+// such as bus voltage or temperature
 float fixed16_to_float(uint16_t fx);
 float fixed32_to_float(uint32_t fx);
 
+// Signed 8.8 and 16.16 fixed point, for setpoints, gains and positions. 
+// Rounds to nearest and saturates.
+int16_t double_to_fixed16(double value);
+int32_t double_to_fixed32(double value);
+
+// Batch conversions of signed 8.8 and 16.16 fixed point, written to be 
+// vectorized by the compiler at -O3. Unlike fixed16_to_float() and 
+// fixed32_to_float() they read values as signed, so they only agree with 
+// them below 128 and 32768. Conversions to fixed point round to nearest and 
+// saturate, and return the number of results at a range limit.
+int fixed16_to_floats(const int16_t *fx, float *values, size_t count);
+int fixed16_to_doubles(const int16_t *fx, double *values, size_t count);
+int fixed32_to_floats(const int32_t *fx, float *values, size_t count);
+int fixed32_to_doubles(const int32_t *fx, double *values, size_t count);
+int floats_to_fixed16(const float *values, int16_t *fx, size_t count);
+int doubles_to_fixed16(const double *values, int16_t *fx, size_t count);
+int floats_to_fixed32(const float *values, int32_t *fx, size_t count);
+int doubles_to_fixed32(const double *values, int32_t *fx, size_t count);
+
 #endif
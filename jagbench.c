@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+
+#include "jagsim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmarks for the frame codec and for every api call against the
+// simulated bus. Results are written as one JSON object per line.
+//
+// usage: jagbench [codec|api|serial|all] [-n iterations] [-b baud] [-o file]
+
+#define DEFAULT_ITERATIONS 2000
+#define CODEC_ITERATIONS   1000000
+#define BENCH_DEVICE       1
+#define BENCH_DEVICES      6
+
+typedef struct BenchOptions {
+    int iterations;
+    uint32_t baud;
+    const char *output;
+} BenchOptions;
+
+typedef int (*BenchCall)(JaguarConnection *conn, uint8_t device);
+
+typedef struct BenchApi {
+    const char *name;
+    BenchCall call;
+} BenchApi;
+
+static uint64_t time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x;
+    uint64_t y;
+
+    x = *(const uint64_t *) a;
+    y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int count, double fraction)
+{
+    int index;
+
+    index = (int) (fraction * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+// Fill a message whose data bytes need escaping with the given probability
+static void fill_message(CANMessage *message, int size, int escape_percent,
+        unsigned int *seed)
+{
+    int i;
+
+    init_jaguar_message(message, API_POSITION, POSITION_SET);
+    message->device = BENCH_DEVICE;
+    message->data_size = (uint8_t) size;
+    for (i = 0; i < size; i++) {
+        if ((int) (rand_r(seed) % 100) < escape_percent) {
+            message->data[i] = (i & 1) ? START_OF_FRAME : ENCODE_BYTE_A;
+        } else {
+            message->data[i] = (uint8_t) (rand_r(seed) % ENCODE_BYTE_B);
+        }
+    }
+}
+
+static void bench_codec(FILE *out)
+{
+    static const int densities[] = { 0, 25, 50, 100 };
+    CANMessage message;
+    CANMessage decoded;
+    CANEncodedMsg encoded;
+    unsigned int seed;
+    uint64_t start;
+    uint64_t encode_ns;
+    uint64_t decode_ns;
+    int size;
+    int d;
+    int i;
+
+    seed = 1;
+    for (size = 0; size <= MAX_DATA_BYTES; size++) {
+        for (d = 0; d < (int) (sizeof(densities) / sizeof(densities[0]));
+                d++) {
+            fill_message(&message, size, densities[d], &seed);
+
+            start = time_ns();
+            for (i = 0; i < CODEC_ITERATIONS; i++) {
+                encode_can_message(&message, &encoded);
+                __asm__ __volatile__("" : : "r" (&encoded) : "memory");
+            }
+            encode_ns = time_ns() - start;
+
+            start = time_ns();
+            for (i = 0; i < CODEC_ITERATIONS; i++) {
+                decode_can_message(&encoded, &decoded);
+                __asm__ __volatile__("" : : "r" (&decoded) : "memory");
+            }
+            decode_ns = time_ns() - start;
+
+            fprintf(out, "{\"bench\":\"codec\",\"data_bytes\":%d,"
+                    "\"escape_percent\":%d,\"encoded_bytes\":%d,"
+                    "\"encode_ns\":%.2f,\"decode_ns\":%.2f}\n",
+                    size, densities[d], encoded.size,
+                    (double) encode_ns / CODEC_ITERATIONS,
+                    (double) decode_ns / CODEC_ITERATIONS);
+        }
+    }
+}
+
+static int call_sys_heartbeat(JaguarConnection *conn, uint8_t device)
+{
+    return sys_heartbeat(conn, device);
+}
+
+static int call_sys_sync_update(JaguarConnection *conn, uint8_t device)
+{
+    (void) device;
+    return sys_sync_update(conn, 0);
+}
+
+static int call_sys_halt(JaguarConnection *conn, uint8_t device)
+{
+    return sys_halt(conn, device);
+}
+
+static int call_sys_reset(JaguarConnection *conn, uint8_t device)
+{
+    return sys_reset(conn, device);
+}
+
+static int call_sys_resume(JaguarConnection *conn, uint8_t device)
+{
+    return sys_resume(conn, device);
+}
+
+static int call_voltage_enable(JaguarConnection *conn, uint8_t device)
+{
+    return voltage_enable(conn, device);
+}
+
+static int call_voltage_disable(JaguarConnection *conn, uint8_t device)
+{
+    return voltage_disable(conn, device);
+}
+
+static int call_voltage_set(JaguarConnection *conn, uint8_t device)
+{
+    return voltage_set(conn, device, 1000);
+}
+
+static int call_voltage_set_sync(JaguarConnection *conn, uint8_t device)
+{
+    return voltage_set_sync(conn, device, 1000, 1);
+}
+
+static int call_voltage_set_sync_batch(JaguarConnection *conn, 
+        uint8_t device)
+{
+    JaguarSetpoint setpoints[BENCH_DEVICES];
+    int i;
+
+    for (i = 0; i < BENCH_DEVICES; i++) {
+        setpoints[i].device = (uint8_t) (device + i);
+        setpoints[i].value = 1000;
+    }
+    return voltage_set_sync_batch(conn, setpoints, BENCH_DEVICES, 1);
+}
+
+static int call_voltage_get(JaguarConnection *conn, uint8_t device)
+{
+    int16_t voltage;
+    return voltage_get(conn, device, &voltage);
+}
+
+static int call_voltage_ramp(JaguarConnection *conn, uint8_t device)
+{
+    return voltage_ramp(conn, device, 0);
+}
+
+static int call_position_enable(JaguarConnection *conn, uint8_t device)
+{
+    return position_enable(conn, device, 0);
+}
+
+static int call_position_disable(JaguarConnection *conn, uint8_t device)
+{
+    return position_disable(conn, device);
+}
+
+static int call_position_set(JaguarConnection *conn, uint8_t device)
+{
+    return position_set(conn, device, 0x10000);
+}
+
+static int call_position_set_sync(JaguarConnection *conn, uint8_t device)
+{
+    return position_set_sync(conn, device, 0x10000, 1);
+}
+
+static int call_position_get(JaguarConnection *conn, uint8_t device)
+{
+    int32_t position;
+    return position_get(conn, device, &position);
+}
+
+static int call_position_p(JaguarConnection *conn, uint8_t device)
+{
+    return position_p(conn, device, 0x10000);
+}
+
+static int call_position_i(JaguarConnection *conn, uint8_t device)
+{
+    return position_i(conn, device, 0);
+}
+
+static int call_position_d(JaguarConnection *conn, uint8_t device)
+{
+    return position_d(conn, device, 0);
+}
+
+static int call_position_pid(JaguarConnection *conn, uint8_t device)
+{
+    return position_pid(conn, device, 0x10000, 0, 0);
+}
+
+static int call_position_ref_encoder(JaguarConnection *conn, uint8_t device)
+{
+    return position_ref_encoder(conn, device);
+}
+
+static int call_status_output_percent(JaguarConnection *conn, uint8_t device)
+{
+    int16_t output_percent;
+    return status_output_percent(conn, device, &output_percent);
+}
+
+static int call_status_temperature(JaguarConnection *conn, uint8_t device)
+{
+    uint16_t temperature;
+    return status_temperature(conn, device, &temperature);
+}
+
+static int call_status_position(JaguarConnection *conn, uint8_t device)
+{
+    uint32_t position;
+    return status_position(conn, device, &position);
+}
+
+static int call_status_mode(JaguarConnection *conn, uint8_t device)
+{
+    uint8_t mode;
+    return status_mode(conn, device, &mode);
+}
+
+static int call_status_position_cached(JaguarConnection *conn, 
+        uint8_t device)
+{
+    uint32_t position;
+    return status_position_cached(conn, device, 1000, &position);
+}
+
+static int call_config_encoder_lines(JaguarConnection *conn, uint8_t device)
+{
+    return config_encoder_lines(conn, device, 360);
+}
+
+static int call_get_encoder_lines(JaguarConnection *conn, uint8_t device)
+{
+    uint16_t lines;
+    return get_encoder_lines(conn, device, &lines);
+}
+
+static const BenchApi apis[] = {
+    { "sys_heartbeat", call_sys_heartbeat },
+    { "sys_sync_update", call_sys_sync_update },
+    { "sys_halt", call_sys_halt },
+    { "sys_reset", call_sys_reset },
+    { "sys_resume", call_sys_resume },
+    { "voltage_enable", call_voltage_enable },
+    { "voltage_disable", call_voltage_disable },
+    { "voltage_set", call_voltage_set },
+    { "voltage_set_sync", call_voltage_set_sync },
+    { "voltage_set_sync_batch", call_voltage_set_sync_batch },
+    { "voltage_get", call_voltage_get },
+    { "voltage_ramp", call_voltage_ramp },
+    { "position_enable", call_position_enable },
+    { "position_disable", call_position_disable },
+    { "position_set", call_position_set },
+    { "position_set_sync", call_position_set_sync },
+    { "position_get", call_position_get },
+    { "position_p", call_position_p },
+    { "position_i", call_position_i },
+    { "position_d", call_position_d },
+    { "position_pid", call_position_pid },
+    { "position_ref_encoder", call_position_ref_encoder },
+    { "status_output_percent", call_status_output_percent },
+    { "status_temperature", call_status_temperature },
+    { "status_position", call_status_position },
+    { "status_mode", call_status_mode },
+    { "status_position_cached", call_status_position_cached },
+    { "config_encoder_lines", call_config_encoder_lines },
+    { "get_encoder_lines", call_get_encoder_lines },
+};
+
+static int bench_api(FILE *out, BenchOptions *options)
+{
+    JaguarSim sim;
+    JaguarSimOptions sim_options;
+    JaguarConnection conn;
+    uint64_t *samples;
+    uint64_t start;
+    uint64_t total;
+    int errors;
+    int a;
+    int i;
+
+    init_jaguar_sim_options(&sim_options);
+    sim_options.baud = options->baud;
+    if (open_jaguar_sim(&sim, BENCH_DEVICES, &sim_options) != JAGUAR_OK) {
+        fprintf(stderr, "jagbench: could not start simulator\n");
+        return 1;
+    }
+    if (open_jaguar_connection(&conn, sim.port_name) != JAGUAR_OK) {
+        fprintf(stderr, "jagbench: could not open %s\n", sim.port_name);
+        close_jaguar_sim(&sim);
+        return 1;
+    }
+
+    samples = malloc(sizeof(uint64_t) * options->iterations);
+    if (samples == NULL) {
+        fprintf(stderr, "jagbench: out of memory\n");
+        close_jaguar_connection(&conn);
+        close_jaguar_sim(&sim);
+        return 1;
+    }
+    for (a = 0; a < (int) (sizeof(apis) / sizeof(apis[0])); a++) {
+        errors = 0;
+        total = 0;
+        for (i = 0; i < options->iterations; i++) {
+            start = time_ns();
+            if (apis[a].call(&conn, BENCH_DEVICE) != JAGUAR_OK) {
+                errors += 1;
+            }
+            samples[i] = time_ns() - start;
+            total += samples[i];
+        }
+
+        qsort(samples, options->iterations, sizeof(uint64_t), compare_u64);
+        fprintf(out, "{\"bench\":\"api\",\"call\":\"%s\",\"baud\":%u,"
+                "\"iterations\":%d,\"errors\":%d,\"p50_us\":%.1f,"
+                "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+                "\"calls_per_sec\":%.0f}\n",
+                apis[a].name, options->baud, options->iterations, errors,
+                percentile(samples, options->iterations, 0.5) / 1000.0,
+                percentile(samples, options->iterations, 0.99) / 1000.0,
+                percentile(samples, options->iterations, 0.999) / 1000.0,
+                samples[options->iterations - 1] / 1000.0,
+                options->iterations * 1e9 / (double) total);
+        fflush(out);
+    }
+    free(samples);
+
+    close_jaguar_connection(&conn);
+    close_jaguar_sim(&sim);
+
+    return 0;
+}
+
+// Round trips achieved by each serial tuning profile
+static int bench_serial(FILE *out, BenchOptions *options)
+{
+    static const char *names[JAGUAR_SERIAL_PROFILES] = {
+        "default", "low_latency", "spin"
+    };
+    JaguarLatencyReport reports[JAGUAR_SERIAL_PROFILES];
+    JaguarSim sim;
+    JaguarSimOptions sim_options;
+    uint32_t baud;
+    int count;
+    int p;
+
+    init_jaguar_sim_options(&sim_options);
+    sim_options.baud = options->baud;
+    if (open_jaguar_sim(&sim, BENCH_DEVICES, &sim_options) != JAGUAR_OK) {
+        fprintf(stderr, "jagbench: could not start simulator\n");
+        return 1;
+    }
+
+    baud = options->baud != 0 ? options->baud : JAGUAR_DEFAULT_BAUD;
+    count = options->iterations;
+    if (count > JAGUAR_SELF_TEST_MAX) {
+        count = JAGUAR_SELF_TEST_MAX;
+    }
+    compare_jaguar_serial_profiles(sim.port_name, baud, BENCH_DEVICE, count,
+            reports);
+    for (p = 0; p < JAGUAR_SERIAL_PROFILES; p++) {
+        fprintf(out, "{\"bench\":\"serial\",\"profile\":\"%s\","
+                "\"baud\":%u,\"samples\":%d,\"errors\":%d,"
+                "\"min_us\":%u,\"p50_us\":%u,\"p99_us\":%u,"
+                "\"max_us\":%u,\"mean_us\":%u}\n",
+                names[p], baud, reports[p].samples, reports[p].failures,
+                reports[p].min_us, reports[p].median_us, reports[p].p99_us,
+                reports[p].max_us, reports[p].mean_us);
+    }
+    fflush(out);
+
+    close_jaguar_sim(&sim);
+
+    return 0;
+}
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [codec|api|serial|all] "
+            "[-n iterations] [-b baud] [-o file]\n", name);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    const char *mode;
+    FILE *out;
+    int result;
+    int i;
+
+    mode = "all";
+    options.iterations = DEFAULT_ITERATIONS;
+    options.baud = 0;
+    options.output = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            options.baud = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (argv[i][0] != '-') {
+            mode = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (strcmp(mode, "codec") != 0 && strcmp(mode, "api") != 0
+            && strcmp(mode, "serial") != 0 && strcmp(mode, "all") != 0) {
+        return usage(argv[0]);
+    }
+    if (options.iterations < 1) {
+        options.iterations = 1;
+    }
+
+    out = stdout;
+    if (options.output != NULL) {
+        out = fopen(options.output, "w");
+        if (out == NULL) {
+            perror(options.output);
+            return 1;
+        }
+    }
+
+    result = 0;
+    if (strcmp(mode, "codec") == 0 || strcmp(mode, "all") == 0) {
+        bench_codec(out);
+    }
+    if (strcmp(mode, "api") == 0 || strcmp(mode, "all") == 0) {
+        result = bench_api(out, &options);
+    }
+    if (strcmp(mode, "serial") == 0 || strcmp(mode, "all") == 0) {
+        result |= bench_serial(out, &options);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return result;
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+
+#include "jagcapture.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Capture logs start with this tag and a format version, followed by the
+// records. A record is the little endian time in microseconds, the
+// direction, the frame size and the encoded frame.
+#define CAPTURE_MAGIC        "JCAP"
+#define CAPTURE_FORMAT       1
+#define CAPTURE_HEADER_SIZE  5
+#define CAPTURE_RECORD_SIZE  10
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return JAGUAR_ERROR;
+        }
+        data += written;
+        size -= (size_t) written;
+    }
+
+    return JAGUAR_OK;
+}
+
+// Copy a frame into the active buffer, waking the writer once it is half
+// full. Runs on the io path, so it never waits for the disk.
+static void capture_frame(JaguarConnection *conn, int direction,
+        CANMessage *message, void *context)
+{
+    JaguarCapture *capture;
+    CANEncodedMsg encoded_message;
+    uint64_t time_us;
+    uint8_t *record;
+    size_t used;
+    int i;
+
+    (void) conn;
+    capture = context;
+    time_us = jaguar_time_us();
+    encode_can_message(message, &encoded_message);
+
+    pthread_mutex_lock(&capture->lock);
+    used = capture->used[capture->active];
+    if (used + CAPTURE_RECORD_SIZE + encoded_message.size
+            > JAGUAR_CAPTURE_BUFFER) {
+        capture->stats.dropped += 1;
+        pthread_mutex_unlock(&capture->lock);
+        return;
+    }
+
+    record = &capture->buffer[capture->active][used];
+    for (i = 0; i < 8; i++) {
+        record[i] = (uint8_t) (time_us >> (8 * i));
+    }
+    record[8] = (uint8_t) direction;
+    record[9] = encoded_message.size;
+    memcpy(&record[CAPTURE_RECORD_SIZE], encoded_message.data,
+            encoded_message.size);
+    capture->used[capture->active] = used + CAPTURE_RECORD_SIZE
+            + encoded_message.size;
+    capture->stats.frames += 1;
+
+    if (used < JAGUAR_CAPTURE_BUFFER / 2
+            && capture->used[capture->active] >= JAGUAR_CAPTURE_BUFFER / 2) {
+        pthread_cond_signal(&capture->wake);
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Swap the buffers and write out the full one, until stopped and empty
+static void *jaguar_capture_thread(void *arg)
+{
+    JaguarCapture *capture;
+    struct timespec deadline;
+    uint64_t deadline_us;
+    size_t size;
+    int full;
+    bool stop;
+
+    capture = arg;
+    pthread_mutex_lock(&capture->lock);
+    for (;;) {
+        deadline_us = jaguar_time_us() + JAGUAR_CAPTURE_FLUSH_US;
+        deadline.tv_sec = deadline_us / 1000000;
+        deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+        while (!capture->stop
+                && capture->used[capture->active] < JAGUAR_CAPTURE_BUFFER / 2
+                && jaguar_time_us() < deadline_us) {
+            pthread_cond_timedwait(&capture->wake, &capture->lock,
+                    &deadline);
+        }
+
+        stop = capture->stop;
+        full = capture->active;
+        size = capture->used[full];
+        capture->active = 1 - full;
+        pthread_mutex_unlock(&capture->lock);
+
+        if (size > 0 && write_all(capture->fd, capture->buffer[full], size)
+                != JAGUAR_OK) {
+            pthread_mutex_lock(&capture->lock);
+            capture->stats.write_errors += 1;
+            pthread_mutex_unlock(&capture->lock);
+            size = 0;
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        capture->used[full] = 0;
+        capture->stats.bytes_written += size;
+        if (stop) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return NULL;
+}
+
+// Start recording the traffic of conn to a new log at path
+int start_jaguar_capture(JaguarCapture *capture, JaguarConnection *conn,
+        const char *path)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    pthread_condattr_t cond_attr;
+
+    memset(capture, 0, sizeof(JaguarCapture));
+    capture->conn = conn;
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture->fd < 0) {
+        return JAGUAR_ERROR;
+    }
+
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_FORMAT;
+    capture->buffer[0] = malloc(JAGUAR_CAPTURE_BUFFER);
+    capture->buffer[1] = malloc(JAGUAR_CAPTURE_BUFFER);
+    if (capture->buffer[0] == NULL || capture->buffer[1] == NULL
+            || write_all(capture->fd, header, sizeof(header)) != JAGUAR_OK) {
+        free(capture->buffer[0]);
+        free(capture->buffer[1]);
+        close(capture->fd);
+        return JAGUAR_ERROR;
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&capture->wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (pthread_create(&capture->thread, NULL, jaguar_capture_thread,
+            capture) != 0) {
+        pthread_cond_destroy(&capture->wake);
+        pthread_mutex_destroy(&capture->lock);
+        free(capture->buffer[0]);
+        free(capture->buffer[1]);
+        close(capture->fd);
+        return JAGUAR_ERROR;
+    }
+
+    set_jaguar_tap(conn, capture_frame, capture);
+
+    return JAGUAR_OK;
+}
+
+// Stop recording and write out every frame captured so far
+int stop_jaguar_capture(JaguarCapture *capture)
+{
+    int result;
+
+    set_jaguar_tap(capture->conn, NULL, NULL);
+
+    pthread_mutex_lock(&capture->lock);
+    capture->stop = true;
+    pthread_cond_signal(&capture->wake);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+
+    result = capture->stats.write_errors == 0 ? JAGUAR_OK : JAGUAR_ERROR;
+    if (close(capture->fd) != 0) {
+        result = JAGUAR_ERROR;
+    }
+    free(capture->buffer[0]);
+    free(capture->buffer[1]);
+    pthread_cond_destroy(&capture->wake);
+    pthread_mutex_destroy(&capture->lock);
+
+    return result;
+}
+
+int get_jaguar_capture_stats(JaguarCapture *capture,
+        JaguarCaptureStats *stats)
+{
+    pthread_mutex_lock(&capture->lock);
+    *stats = capture->stats;
+    pthread_mutex_unlock(&capture->lock);
+
+    return JAGUAR_OK;
+}
+
+// Feed a capture log to conn as if its traffic had just been received.
+// Received frames go through the frame decoder and on to handlers, the
+// telemetry cache and waiting transactions, sent frames are only counted.
+// With JAGUAR_REPLAY_RECORDED frames are delivered with the spacing they
+// were captured with, with JAGUAR_REPLAY_FAST as fast as they decode.
+int replay_jaguar_capture(JaguarConnection *conn, const char *path, int pace,
+        JaguarReplayStats *stats)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    uint8_t record[CAPTURE_RECORD_SIZE];
+    uint8_t frame[MAX_MSG_BYTES];
+    CANFrameParser parser;
+    CANMessage message;
+    struct timespec deadline;
+    uint64_t first_us;
+    uint64_t start_us;
+    uint64_t time_us;
+    uint64_t due_us;
+    size_t consumed;
+    FILE *file;
+    int result;
+    int i;
+
+    memset(stats, 0, sizeof(JaguarReplayStats));
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return JAGUAR_ERROR;
+    }
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+            || memcmp(header, CAPTURE_MAGIC, 4) != 0
+            || header[4] != CAPTURE_FORMAT) {
+        fclose(file);
+        return JAGUAR_DECODE_ERROR;
+    }
+
+    result = JAGUAR_OK;
+    first_us = 0;
+    start_us = jaguar_time_us();
+    while (fread(record, 1, sizeof(record), file) == sizeof(record)) {
+        time_us = 0;
+        for (i = 0; i < 8; i++) {
+            time_us |= (uint64_t) record[i] << (8 * i);
+        }
+        if (record[9] > MAX_MSG_BYTES
+                || fread(frame, 1, record[9], file) != record[9]) {
+            // a truncated log ends with a partial record
+            result = JAGUAR_DECODE_ERROR;
+            break;
+        }
+
+        if (stats->records == 0) {
+            first_us = time_us;
+        }
+        stats->records += 1;
+        if (pace == JAGUAR_REPLAY_RECORDED && time_us > first_us) {
+            due_us = start_us + (time_us - first_us);
+            if (due_us > jaguar_time_us()) {
+                deadline.tv_sec = due_us / 1000000;
+                deadline.tv_nsec = (due_us % 1000000) * 1000;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                        &deadline, NULL) == EINTR) {
+                }
+            }
+        }
+
+        if (record[8] == JAGUAR_TAP_TX) {
+            stats->frames_sent += 1;
+            continue;
+        }
+        init_frame_parser(&parser);
+        if (parse_can_bytes(&parser, frame, record[9], &consumed, &message)
+                != PARSE_FRAME) {
+            stats->decode_errors += 1;
+            continue;
+        }
+        inject_jaguar_message(conn, &message);
+        stats->frames_received += 1;
+    }
+    stats->elapsed_us = jaguar_time_us() - start_us;
+    fclose(file);
+
+    return result;
+}
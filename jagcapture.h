@@ -0,0 +1,60 @@
+#ifndef JAGCAPTURE_H
+#define JAGCAPTURE_H
+
+#include "libjaguar.h"
+
+// Size of each of the two capture buffers. Frames are appended to one
+// while the writer saves the other, and are dropped if both are full.
+#define JAGUAR_CAPTURE_BUFFER 262144
+
+// Longest time a captured frame waits in memory before it is written
+#define JAGUAR_CAPTURE_FLUSH_US 100000
+
+// Replay pacing
+#define JAGUAR_REPLAY_RECORDED 0
+#define JAGUAR_REPLAY_FAST     1
+
+typedef struct JaguarCaptureStats {
+    uint64_t frames;
+    uint64_t bytes_written;
+    // Frames lost because the writer could not keep up
+    uint64_t dropped;
+    uint64_t write_errors;
+} JaguarCaptureStats;
+
+// Records every frame a connection sends and receives to a log file. The
+// io path only copies frames into memory, a background thread writes them.
+// Each record is the monotonic time in microseconds, the direction and the
+// frame in its serial encoding, so a log looks the same whatever the
+// transport.
+typedef struct JaguarCapture {
+    JaguarConnection *conn;
+    int fd;
+    uint8_t *buffer[2];
+    size_t used[2];
+    int active;
+    JaguarCaptureStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool stop;
+} JaguarCapture;
+
+typedef struct JaguarReplayStats {
+    uint64_t records;
+    uint64_t frames_received;
+    uint64_t frames_sent;
+    uint64_t decode_errors;
+    uint64_t elapsed_us;
+} JaguarReplayStats;
+
+int start_jaguar_capture(JaguarCapture *capture, JaguarConnection *conn,
+        const char *path);
+int stop_jaguar_capture(JaguarCapture *capture);
+int get_jaguar_capture_stats(JaguarCapture *capture,
+        JaguarCaptureStats *stats);
+
+int replay_jaguar_capture(JaguarConnection *conn, const char *path, int pace,
+        JaguarReplayStats *stats);
+
+#endif
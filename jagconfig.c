@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include "jagconfig.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Saved configurations start with this tag and a format version, followed
+// by a count byte and one fixed size little endian record per device
+#define CONFIG_MAGIC        "JCFG"
+#define CONFIG_FORMAT       1
+#define CONFIG_HEADER_SIZE  6
+#define CONFIG_RECORD_SIZE  19
+
+// How each managed parameter is read and written. Reads of the encoder
+// lines are answered without an acknowledgement.
+typedef struct ConfigParam {
+    uint8_t field;
+    uint8_t api_class;
+    uint8_t api_index;
+    uint8_t size;
+    uint8_t read_expect;
+} ConfigParam;
+
+static const ConfigParam config_params[JAGUAR_CONFIG_PARAMS] = {
+    {JAGUAR_CONFIG_ENCODER_LINES, API_CONFIG, CONFIG_ENCODER_LINES, 2,
+            JAGUAR_EXPECT_REPLY},
+    {JAGUAR_CONFIG_POSITION_P, API_POSITION, POSITION_P, 4,
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK},
+    {JAGUAR_CONFIG_POSITION_I, API_POSITION, POSITION_I, 4,
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK},
+    {JAGUAR_CONFIG_POSITION_D, API_POSITION, POSITION_D, 4,
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK},
+    {JAGUAR_CONFIG_POSITION_REF, API_POSITION, POSITION_REF, 1,
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK},
+    {JAGUAR_CONFIG_VOLTAGE_RAMP, API_VOLTAGE, VOLTAGE_RAMP, 2,
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK},
+};
+
+// Parameter values as raw wire values, truncated to their size
+static uint32_t get_config_value(const JaguarConfig *config, uint8_t field)
+{
+    switch (field) {
+    case JAGUAR_CONFIG_ENCODER_LINES:
+        return config->encoder_lines;
+    case JAGUAR_CONFIG_POSITION_P:
+        return (uint32_t) config->position_p;
+    case JAGUAR_CONFIG_POSITION_I:
+        return (uint32_t) config->position_i;
+    case JAGUAR_CONFIG_POSITION_D:
+        return (uint32_t) config->position_d;
+    case JAGUAR_CONFIG_POSITION_REF:
+        return config->position_ref;
+    case JAGUAR_CONFIG_VOLTAGE_RAMP:
+        return config->voltage_ramp;
+    default:
+        return 0;
+    }
+}
+
+static void set_config_value(JaguarConfig *config, uint8_t field,
+        uint32_t value)
+{
+    switch (field) {
+    case JAGUAR_CONFIG_ENCODER_LINES:
+        config->encoder_lines = (uint16_t) value;
+        break;
+    case JAGUAR_CONFIG_POSITION_P:
+        config->position_p = (int32_t) value;
+        break;
+    case JAGUAR_CONFIG_POSITION_I:
+        config->position_i = (int32_t) value;
+        break;
+    case JAGUAR_CONFIG_POSITION_D:
+        config->position_d = (int32_t) value;
+        break;
+    case JAGUAR_CONFIG_POSITION_REF:
+        config->position_ref = (uint8_t) value;
+        break;
+    case JAGUAR_CONFIG_VOLTAGE_RAMP:
+        config->voltage_ramp = (uint16_t) value;
+        break;
+    default:
+        break;
+    }
+}
+
+static void put_le(uint8_t *buffer, uint32_t value, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        buffer[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static uint32_t get_le(const uint8_t *buffer, int size)
+{
+    uint32_t value;
+    int i;
+
+    value = 0;
+    for (i = 0; i < size; i++) {
+        value |= (uint32_t) buffer[i] << (8 * i);
+    }
+
+    return value;
+}
+
+// Write the configuration of count devices, replacing the file at path only
+// once the new contents are complete
+int save_jaguar_config(const char *path, const JaguarConfig *configs,
+        int count)
+{
+    uint8_t record[CONFIG_RECORD_SIZE];
+    uint8_t header[CONFIG_HEADER_SIZE];
+    char temp_path[256];
+    FILE *file;
+    bool failed;
+    int i;
+
+    if (count < 0 || count > JAGUAR_MAX_DEVICES
+            || snprintf(temp_path, sizeof(temp_path), "%s.tmp", path)
+                    >= (int) sizeof(temp_path)) {
+        return JAGUAR_ERROR;
+    }
+
+    file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        return JAGUAR_ERROR;
+    }
+
+    memcpy(header, CONFIG_MAGIC, 4);
+    header[4] = CONFIG_FORMAT;
+    header[5] = (uint8_t) count;
+    failed = fwrite(header, sizeof(header), 1, file) != 1;
+
+    for (i = 0; i < count && !failed; i++) {
+        record[0] = configs[i].device;
+        record[1] = configs[i].fields;
+        put_le(&record[2], configs[i].encoder_lines, 2);
+        put_le(&record[4], (uint32_t) configs[i].position_p, 4);
+        put_le(&record[8], (uint32_t) configs[i].position_i, 4);
+        put_le(&record[12], (uint32_t) configs[i].position_d, 4);
+        record[16] = configs[i].position_ref;
+        put_le(&record[17], configs[i].voltage_ramp, 2);
+        failed = fwrite(record, sizeof(record), 1, file) != 1;
+    }
+
+    failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+// Read a configuration written by save_jaguar_config(). Returns
+// JAGUAR_DECODE_ERROR if the file is not a saved configuration or holds
+// more than max devices.
+int load_jaguar_config(const char *path, JaguarConfig *configs, int max,
+        int *count)
+{
+    uint8_t record[CONFIG_RECORD_SIZE];
+    uint8_t header[CONFIG_HEADER_SIZE];
+    FILE *file;
+    int result;
+    int i;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return JAGUAR_ERROR;
+    }
+
+    if (fread(header, sizeof(header), 1, file) != 1
+            || memcmp(header, CONFIG_MAGIC, 4) != 0
+            || header[4] != CONFIG_FORMAT || header[5] > max) {
+        fclose(file);
+        return JAGUAR_DECODE_ERROR;
+    }
+
+    result = JAGUAR_OK;
+    for (i = 0; i < header[5]; i++) {
+        if (fread(record, sizeof(record), 1, file) != 1) {
+            result = JAGUAR_DECODE_ERROR;
+            break;
+        }
+        configs[i].device = record[0];
+        configs[i].fields = record[1];
+        configs[i].encoder_lines = (uint16_t) get_le(&record[2], 2);
+        configs[i].position_p = (int32_t) get_le(&record[4], 4);
+        configs[i].position_i = (int32_t) get_le(&record[8], 4);
+        configs[i].position_d = (int32_t) get_le(&record[12], 4);
+        configs[i].position_ref = record[16];
+        configs[i].voltage_ramp = (uint16_t) get_le(&record[17], 2);
+    }
+    fclose(file);
+
+    if (result == JAGUAR_OK) {
+        *count = header[5];
+    }
+
+    return result;
+}
+
+// List one operation per managed parameter of each device, encoded as the
+// device's index in configs times JAGUAR_CONFIG_PARAMS plus the parameter
+static int list_config_ops(const JaguarConfig *configs, int count,
+        uint16_t *ops)
+{
+    int op_count;
+    int i;
+    int n;
+
+    op_count = 0;
+    for (i = 0; i < count; i++) {
+        for (n = 0; n < JAGUAR_CONFIG_PARAMS; n++) {
+            if (configs[i].fields & config_params[n].field) {
+                ops[op_count] = (uint16_t) (i * JAGUAR_CONFIG_PARAMS + n);
+                op_count += 1;
+            }
+        }
+    }
+
+    return op_count;
+}
+
+// Start reading or writing the parameters of a batch of operations, the
+// caller waits for all of them
+static void start_config_batch(JaguarConnection *conn, JaguarTransaction *txs,
+        const JaguarConfig *configs, const uint16_t *ops, int count,
+        bool write)
+{
+    const JaguarConfig *config;
+    const ConfigParam *param;
+    CANMessage message;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        config = &configs[ops[i] / JAGUAR_CONFIG_PARAMS];
+        param = &config_params[ops[i] % JAGUAR_CONFIG_PARAMS];
+
+        init_jaguar_message(&message, param->api_class, param->api_index);
+        message.device = config->device;
+        message.data_size = 0;
+        if (write) {
+            message.data_size = param->size;
+            put_le(message.data, get_config_value(config, param->field),
+                    param->size);
+        }
+
+        init_jaguar_transaction(&txs[i], &message,
+                write ? JAGUAR_EXPECT_ACK : param->read_expect);
+        submit_jaguar_transaction(conn, &txs[i]);
+    }
+}
+
+// The value a read returned, in the same form as get_config_value()
+static int get_config_reply(JaguarTransaction *tx, const ConfigParam *param,
+        uint32_t *value)
+{
+    if (tx->status != JAGUAR_OK) {
+        return tx->status;
+    }
+    if (tx->reply.data_size < param->size) {
+        return JAGUAR_DECODE_ERROR;
+    }
+
+    *value = get_le(tx->reply.data, param->size);
+
+    return JAGUAR_OK;
+}
+
+// Fill in the managed parameters of each configuration with the values
+// currently on its device, for instance to take a snapshot to save
+int read_jaguar_config(JaguarConnection *conn, JaguarConfig *configs,
+        int count)
+{
+    JaguarTransaction txs[JAGUAR_CONFIG_BATCH];
+    uint16_t ops[JAGUAR_MAX_DEVICES * JAGUAR_CONFIG_PARAMS];
+    const ConfigParam *param;
+    uint32_t value;
+    int op_count;
+    int batch;
+    int start;
+    int status;
+    int result;
+    int i;
+
+    if (count < 0 || count > JAGUAR_MAX_DEVICES) {
+        return JAGUAR_ERROR;
+    }
+
+    result = JAGUAR_OK;
+    op_count = list_config_ops(configs, count, ops);
+    for (start = 0; start < op_count; start += batch) {
+        batch = op_count - start < JAGUAR_CONFIG_BATCH
+                ? op_count - start : JAGUAR_CONFIG_BATCH;
+        start_config_batch(conn, txs, configs, &ops[start], batch, false);
+        wait_jaguar_transactions(conn, txs, batch);
+
+        for (i = 0; i < batch; i++) {
+            param = &config_params[ops[start + i] % JAGUAR_CONFIG_PARAMS];
+            status = get_config_reply(&txs[i], param, &value);
+            if (status == JAGUAR_OK) {
+                set_config_value(&configs[ops[start + i]
+                        / JAGUAR_CONFIG_PARAMS], param->field, value);
+            } else {
+                result = status;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Bring the devices to their configurations. Every managed parameter is
+// read back first, keeping a batch of reads in flight, and only those that
+// differ or could not be read are written. written receives the number of
+// parameters sent, it may be NULL. Returns the last write failure, if any.
+int sync_jaguar_config(JaguarConnection *conn, const JaguarConfig *configs,
+        int count, int *written)
+{
+    JaguarTransaction txs[JAGUAR_CONFIG_BATCH];
+    uint16_t ops[JAGUAR_MAX_DEVICES * JAGUAR_CONFIG_PARAMS];
+    uint16_t writes[JAGUAR_MAX_DEVICES * JAGUAR_CONFIG_PARAMS];
+    const JaguarConfig *config;
+    const ConfigParam *param;
+    uint32_t value;
+    int write_count;
+    int op_count;
+    int batch;
+    int start;
+    int status;
+    int result;
+    int i;
+
+    if (count < 0 || count > JAGUAR_MAX_DEVICES) {
+        return JAGUAR_ERROR;
+    }
+
+    write_count = 0;
+    op_count = list_config_ops(configs, count, ops);
+    for (start = 0; start < op_count; start += batch) {
+        batch = op_count - start < JAGUAR_CONFIG_BATCH
+                ? op_count - start : JAGUAR_CONFIG_BATCH;
+        start_config_batch(conn, txs, configs, &ops[start], batch, false);
+        wait_jaguar_transactions(conn, txs, batch);
+
+        for (i = 0; i < batch; i++) {
+            config = &configs[ops[start + i] / JAGUAR_CONFIG_PARAMS];
+            param = &config_params[ops[start + i] % JAGUAR_CONFIG_PARAMS];
+            if (get_config_reply(&txs[i], param, &value) != JAGUAR_OK
+                    || value != (get_config_value(config, param->field)
+                            & (0xffffffffu >> (32 - 8 * param->size)))) {
+                writes[write_count] = ops[start + i];
+                write_count += 1;
+            }
+        }
+    }
+
+    result = JAGUAR_OK;
+    for (start = 0; start < write_count; start += batch) {
+        batch = write_count - start < JAGUAR_CONFIG_BATCH
+                ? write_count - start : JAGUAR_CONFIG_BATCH;
+        start_config_batch(conn, txs, configs, &writes[start], batch, true);
+        status = wait_jaguar_transactions(conn, txs, batch);
+        if (status != JAGUAR_OK) {
+            result = status;
+        }
+    }
+
+    if (written != NULL) {
+        *written = write_count;
+    }
+
+    return result;
+}
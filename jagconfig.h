@@ -0,0 +1,47 @@
+#ifndef JAGCONFIG_H
+#define JAGCONFIG_H
+
+#include "libjaguar.h"
+
+// Parameters a JaguarConfig manages, one bit each
+#define JAGUAR_CONFIG_ENCODER_LINES 0x01
+#define JAGUAR_CONFIG_POSITION_P    0x02
+#define JAGUAR_CONFIG_POSITION_I    0x04
+#define JAGUAR_CONFIG_POSITION_D    0x08
+#define JAGUAR_CONFIG_POSITION_REF  0x10
+#define JAGUAR_CONFIG_VOLTAGE_RAMP  0x20
+#define JAGUAR_CONFIG_ALL           0x3f
+
+// Number of parameters a JaguarConfig can manage
+#define JAGUAR_CONFIG_PARAMS 6
+
+// Transactions kept in flight at once while reading or writing parameters.
+// A read is answered with a reply and an ack, about 2ms of a 115200 baud
+// line, so the last answer of a batch still comes in within the timeout.
+#define JAGUAR_CONFIG_BATCH 8
+
+// Desired configuration of one device. Only the parameters selected in
+// fields are read and written, the others are left as they are. Values use
+// the wire formats of the Jaguar api.
+typedef struct JaguarConfig {
+    uint8_t device;
+    uint8_t fields;
+    uint16_t encoder_lines;
+    int32_t position_p;
+    int32_t position_i;
+    int32_t position_d;
+    uint8_t position_ref;
+    uint16_t voltage_ramp;
+} JaguarConfig;
+
+int save_jaguar_config(const char *path, const JaguarConfig *configs,
+        int count);
+int load_jaguar_config(const char *path, JaguarConfig *configs, int max,
+        int *count);
+
+int read_jaguar_config(JaguarConnection *conn, JaguarConfig *configs,
+        int count);
+int sync_jaguar_config(JaguarConnection *conn, const JaguarConfig *configs,
+        int count, int *written);
+
+#endif
@@ -0,0 +1,175 @@
+#include "jagmailbox.h"
+
+#include <string.h>
+
+static void flush_mailboxes(JaguarMailboxes *boxes);
+
+// A setpoint finished, remember what the device has and send the next one
+static void complete_setpoint(JaguarConnection *conn, JaguarTransaction *tx,
+        void *context)
+{
+    JaguarMailbox *mailbox;
+    JaguarMailboxes *boxes;
+
+    (void) conn;
+    mailbox = context;
+    boxes = mailbox->owner;
+
+    pthread_mutex_lock(&boxes->lock);
+    mailbox->in_flight = false;
+    boxes->in_flight -= 1;
+    if (tx->status == JAGUAR_OK) {
+        mailbox->acked = mailbox->sent;
+        mailbox->acked_valid = true;
+    } else {
+        // the device may not have it, send the newest value again
+        mailbox->dirty = true;
+        mailbox->acked_valid = false;
+        boxes->stats.failed += 1;
+    }
+
+    if (boxes->closing) {
+        pthread_cond_broadcast(&boxes->idle);
+    } else {
+        flush_mailboxes(boxes);
+    }
+    pthread_mutex_unlock(&boxes->lock);
+}
+
+// Send the waiting setpoints, oldest cursor position first, while the
+// window has room. Called with the mailbox lock held.
+static void flush_mailboxes(JaguarMailboxes *boxes)
+{
+    JaguarMailbox *mailbox;
+    int result;
+    int scanned;
+
+    for (scanned = 0; scanned < JAGUAR_MAILBOXES
+            && boxes->in_flight < JAGUAR_MAILBOX_WINDOW; scanned++) {
+        mailbox = &boxes->mailbox[boxes->cursor];
+        boxes->cursor = (boxes->cursor + 1) % JAGUAR_MAILBOXES;
+        if (!mailbox->dirty || mailbox->in_flight) {
+            continue;
+        }
+
+        mailbox->dirty = false;
+        if (mailbox->acked_valid && mailbox->value == mailbox->acked) {
+            boxes->stats.skipped += 1;
+            continue;
+        }
+
+        mailbox->sent = mailbox->value;
+        mailbox->in_flight = true;
+        boxes->in_flight += 1;
+        if (mailbox->api_class == API_VOLTAGE) {
+            result = voltage_set_async(boxes->conn, &mailbox->tx,
+                    mailbox->device, (int16_t) mailbox->value,
+                    complete_setpoint, mailbox);
+        } else {
+            result = position_set_async(boxes->conn, &mailbox->tx,
+                    mailbox->device, mailbox->value, complete_setpoint,
+                    mailbox);
+        }
+        if (result != JAGUAR_OK) {
+            // not sent and no completion will follow, retry next time
+            mailbox->in_flight = false;
+            mailbox->dirty = true;
+            boxes->in_flight -= 1;
+            boxes->stats.failed += 1;
+            break;
+        }
+        boxes->stats.sent += 1;
+    }
+}
+
+int open_jaguar_mailboxes(JaguarMailboxes *boxes, JaguarConnection *conn)
+{
+    pthread_condattr_t cond_attr;
+    int i;
+
+    memset(boxes, 0, sizeof(JaguarMailboxes));
+    boxes->conn = conn;
+    for (i = 0; i < JAGUAR_MAILBOXES; i++) {
+        boxes->mailbox[i].owner = boxes;
+        boxes->mailbox[i].device = (uint8_t) (i % JAGUAR_MAX_DEVICES);
+        boxes->mailbox[i].api_class = i < JAGUAR_MAX_DEVICES
+                ? API_VOLTAGE : API_POSITION;
+    }
+
+    pthread_mutex_init(&boxes->lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&boxes->idle, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    return JAGUAR_OK;
+}
+
+// Stop sending and wait for the setpoints in flight, values still waiting
+// are dropped
+int close_jaguar_mailboxes(JaguarMailboxes *boxes)
+{
+    pthread_mutex_lock(&boxes->lock);
+    boxes->closing = true;
+    while (boxes->in_flight > 0) {
+        if (boxes->conn->io_running) {
+            pthread_cond_wait(&boxes->idle, &boxes->lock);
+        } else {
+            // nobody else receives, handle the acknowledgements here
+            pthread_mutex_unlock(&boxes->lock);
+            process_jaguar_messages(boxes->conn,
+                    jaguar_time_us() + boxes->conn->timeout_us);
+            pthread_mutex_lock(&boxes->lock);
+        }
+    }
+    pthread_mutex_unlock(&boxes->lock);
+
+    pthread_cond_destroy(&boxes->idle);
+    pthread_mutex_destroy(&boxes->lock);
+
+    return JAGUAR_OK;
+}
+
+static int post_setpoint(JaguarMailboxes *boxes, JaguarMailbox *mailbox,
+        int32_t value)
+{
+    pthread_mutex_lock(&boxes->lock);
+    if (boxes->closing) {
+        pthread_mutex_unlock(&boxes->lock);
+        return JAGUAR_ERROR;
+    }
+
+    boxes->stats.posted += 1;
+    if (mailbox->dirty) {
+        boxes->stats.coalesced += 1;
+    }
+    mailbox->value = value;
+    mailbox->dirty = true;
+    flush_mailboxes(boxes);
+    pthread_mutex_unlock(&boxes->lock);
+
+    return JAGUAR_OK;
+}
+
+int post_voltage_setpoint(JaguarMailboxes *boxes, uint8_t device,
+        int16_t voltage)
+{
+    return post_setpoint(boxes, &boxes->mailbox[device & 0x3F], voltage);
+}
+
+int post_position_setpoint(JaguarMailboxes *boxes, uint8_t device,
+        int32_t position)
+{
+    return post_setpoint(boxes,
+            &boxes->mailbox[JAGUAR_MAX_DEVICES + (device & 0x3F)], position);
+}
+
+int get_jaguar_mailbox_stats(JaguarMailboxes *boxes,
+        JaguarMailboxStats *stats)
+{
+    pthread_mutex_lock(&boxes->lock);
+    *stats = boxes->stats;
+    pthread_mutex_unlock(&boxes->lock);
+
+    return JAGUAR_OK;
+}
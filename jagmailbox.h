@@ -0,0 +1,68 @@
+#ifndef JAGMAILBOX_H
+#define JAGMAILBOX_H
+
+#include "libjaguar.h"
+
+// Setpoints in flight at once. One frame waits to go out while the device
+// acknowledges the previous one, which keeps the line busy without letting
+// a queue build up behind it.
+#define JAGUAR_MAILBOX_WINDOW 2
+
+// Mailboxes per connection, one voltage and one position mailbox per device
+#define JAGUAR_MAILBOXES (2 * JAGUAR_MAX_DEVICES)
+
+// Latest setpoint for one device in one control mode
+typedef struct JaguarMailbox {
+    struct JaguarMailboxes *owner;
+    JaguarTransaction tx;
+    uint8_t device;
+    uint8_t api_class;
+    // Newest value posted and whether it still has to be sent
+    int32_t value;
+    bool dirty;
+    // Value in flight, and whether there is one
+    int32_t sent;
+    bool in_flight;
+    // Last value the device acknowledged
+    int32_t acked;
+    bool acked_valid;
+} JaguarMailbox;
+
+typedef struct JaguarMailboxStats {
+    uint64_t posted;
+    // Posted values replaced by a newer one before they were sent
+    uint64_t coalesced;
+    // Values not sent because the device already acknowledged them
+    uint64_t skipped;
+    uint64_t sent;
+    uint64_t failed;
+} JaguarMailboxStats;
+
+// Setpoint mailboxes of one connection. Posting a value overwrites any value
+// still waiting in the same mailbox, and the mailboxes are flushed as fast as
+// acknowledgements come back, so a device always gets the newest value next.
+// Flushing is driven by transaction completions and needs an io thread or
+// event loop, or calls to poll_jaguar_messages().
+typedef struct JaguarMailboxes {
+    JaguarConnection *conn;
+    JaguarMailbox mailbox[JAGUAR_MAILBOXES];
+    int in_flight;
+    int cursor;
+    bool closing;
+    JaguarMailboxStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} JaguarMailboxes;
+
+int open_jaguar_mailboxes(JaguarMailboxes *boxes, JaguarConnection *conn);
+int close_jaguar_mailboxes(JaguarMailboxes *boxes);
+
+int post_voltage_setpoint(JaguarMailboxes *boxes, uint8_t device,
+        int16_t voltage);
+int post_position_setpoint(JaguarMailboxes *boxes, uint8_t device,
+        int32_t position);
+
+int get_jaguar_mailbox_stats(JaguarMailboxes *boxes,
+        JaguarMailboxStats *stats);
+
+#endif
@@ -0,0 +1,76 @@
+#include "jagcapture.h"
+#include "jagtransport.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Replays a capture log through the frame decoder and the dispatch path of
+// a connection with nothing on its bus, for load tests that can be
+// repeated and for decoder throughput. Results are written as one JSON
+// object per run.
+//
+// usage: jagreplay [-f] [-n runs] file
+
+int main(int argc, char **argv)
+{
+    JaguarConnection conn;
+    JaguarConnection peer;
+    JaguarReplayStats stats;
+    const char *path;
+    int pace;
+    int runs;
+    int result;
+    int run;
+    int i;
+
+    path = NULL;
+    pace = JAGUAR_REPLAY_RECORDED;
+    runs = 1;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            pace = JAGUAR_REPLAY_FAST;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [-f] [-n runs] file\n", argv[0]);
+        return 1;
+    }
+
+    if (open_jaguar_memory_pair(&conn, &peer) != JAGUAR_OK) {
+        fprintf(stderr, "jagreplay: could not open a connection\n");
+        return 1;
+    }
+
+    result = 0;
+    for (run = 0; run < runs; run++) {
+        if (replay_jaguar_capture(&conn, path, pace, &stats) == JAGUAR_ERROR) {
+            perror(path);
+            result = 1;
+            break;
+        }
+        printf("{\"replay\":\"%s\",\"pace\":\"%s\",\"records\":%llu,"
+                "\"received\":%llu,\"sent\":%llu,\"decode_errors\":%llu,"
+                "\"elapsed_us\":%llu,\"frames_per_sec\":%.0f}\n",
+                path, pace == JAGUAR_REPLAY_FAST ? "fast" : "recorded",
+                (unsigned long long) stats.records,
+                (unsigned long long) stats.frames_received,
+                (unsigned long long) stats.frames_sent,
+                (unsigned long long) stats.decode_errors,
+                (unsigned long long) stats.elapsed_us,
+                stats.elapsed_us > 0
+                ? stats.records * 1e6 / (double) stats.elapsed_us : 0.0);
+        fflush(stdout);
+    }
+
+    close_jaguar_connection(&conn);
+    close_jaguar_connection(&peer);
+
+    return result;
+}
@@ -0,0 +1,773 @@
+#define _GNU_SOURCE
+
+#include "jagsim.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+// Longest time the simulator sleeps without checking for periodic status
+#define JAGSIM_TICK_US 100000
+
+// Frames taken from a transport at once
+#define JAGSIM_BATCH 16
+
+int init_jaguar_sim_options(JaguarSimOptions *options)
+{
+    options->reply_latency_us = 0;
+    options->baud = JAGSIM_DEFAULT_BAUD;
+    options->drop_ppm = 0;
+    options->corrupt_ppm = 0;
+    options->seed = 1;
+    return 0;
+}
+
+static void reset_device(JaguarSimDevice *device)
+{
+    bool present;
+
+    present = device->present;
+    memset(device, 0, sizeof(JaguarSimDevice));
+    device->present = present;
+    device->mode = STATUS_MODE_VOLTAGE;
+    device->temperature = 25 << 8;
+    device->bus_voltage = 12 << 8;
+    device->firmware_version = JAGSIM_FIRMWARE_VERSION;
+}
+
+// Queue a frame for the bus as the devices would send it, applying the
+// configured byte loss, corruption and line rate. Called with the lock
+// held, the frame goes out with flush_frames().
+static void send_frame(JaguarSim *sim, CANMessage *message)
+{
+    CANEncodedMsg encoded_message;
+    JaguarSimFrame *frame;
+    uint32_t roll;
+    int i;
+
+    encode_can_message(message, &encoded_message);
+    if (sim->outbox_count == JAGSIM_OUTBOX) {
+        // more than the line could carry before anyone noticed
+        sim->stats.bytes_dropped += encoded_message.size;
+        return;
+    }
+
+    frame = &sim->outbox[sim->outbox_count];
+    frame->message = *message;
+    frame->size = 0;
+    for (i = 0; i < encoded_message.size; i++) {
+        roll = (uint32_t) rand_r(&sim->options.seed) % 1000000;
+        if (roll < sim->options.drop_ppm) {
+            sim->stats.bytes_dropped += 1;
+            continue;
+        }
+        frame->data[frame->size] = encoded_message.data[i];
+        if (roll < sim->options.drop_ppm + sim->options.corrupt_ppm) {
+            frame->data[frame->size] ^= (uint8_t) (1 << (roll & 7));
+            sim->stats.bytes_corrupted += 1;
+        }
+        frame->size += 1;
+    }
+    frame->whole = frame->size == encoded_message.size;
+
+    // the line is held for as long as the bytes take on the wire
+    frame->delay_us = sim->outbox_delay_us;
+    frame->wire_us = 0;
+    if (sim->options.baud != 0) {
+        frame->wire_us = (uint32_t) ((uint64_t) encoded_message.size * 10
+                * 1000000 / sim->options.baud);
+    }
+    sim->outbox_delay_us = 0;
+    sim->outbox_count += 1;
+
+    // frames on a CAN transport arrive whole, only losses apply
+    if (sim->bus == NULL || frame->whole) {
+        sim->stats.frames_sent += 1;
+        sim->stats.bytes_sent += frame->size;
+    }
+}
+
+// Delay the next frame the devices send, as they take time to answer
+static void delay_frames(JaguarSim *sim, uint32_t delay_us)
+{
+    sim->outbox_delay_us += delay_us;
+}
+
+// Write the queued frames at the line rate, without the lock so the
+// device state stays available meanwhile. Only the simulator thread
+// queues frames.
+static void flush_frames(JaguarSim *sim)
+{
+    JaguarSimFrame *frame;
+    int i;
+
+    for (i = 0; i < sim->outbox_count; i++) {
+        frame = &sim->outbox[i];
+        if (frame->delay_us != 0) {
+            usleep(frame->delay_us);
+        }
+        if (sim->bus != NULL) {
+            if (frame->whole) {
+                send_can_message(sim->bus, &frame->message);
+            }
+        } else if (frame->size > 0) {
+            write(sim->master_fd, frame->data, frame->size);
+        }
+        if (frame->wire_us != 0) {
+            usleep(frame->wire_us);
+        }
+    }
+    sim->outbox_count = 0;
+    sim->outbox_delay_us = 0;
+}
+
+static void send_ack(JaguarSim *sim, uint8_t device)
+{
+    CANMessage ack;
+
+    init_jaguar_message(&ack, API_ACK, 0);
+    ack.device = device;
+    ack.data_size = 0;
+    send_frame(sim, &ack);
+}
+
+static void put16(CANMessage *message, uint16_t value)
+{
+    message->data_size = 2;
+    message->data[0] = (uint8_t) (value & 0x00ff);
+    message->data[1] = (uint8_t) (value >> 8);
+}
+
+static void put32(CANMessage *message, uint32_t value)
+{
+    message->data_size = 4;
+    message->data[0] = (uint8_t) (value & 0x000000ff);
+    message->data[1] = (uint8_t) (value >> 8 & 0x000000ff);
+    message->data[2] = (uint8_t) (value >> 16 & 0x000000ff);
+    message->data[3] = (uint8_t) (value >> 24);
+}
+
+static uint16_t get16(CANMessage *message)
+{
+    return (uint16_t) (message->data[0] | message->data[1] << 8);
+}
+
+static uint32_t get32(CANMessage *message)
+{
+    return (uint32_t) message->data[0] | (uint32_t) message->data[1] << 8
+            | (uint32_t) message->data[2] << 16
+            | (uint32_t) message->data[3] << 24;
+}
+
+static int16_t output_percent(JaguarSimDevice *device)
+{
+    return device->enabled && device->mode == STATUS_MODE_VOLTAGE
+            ? device->voltage : 0;
+}
+
+// Current value of a status field in its wire format
+static uint32_t status_value(JaguarSimDevice *device, uint8_t status_index)
+{
+    switch (status_index) {
+    case STATUS_OUTPUT_PERCENT:
+        return (uint16_t) output_percent(device);
+    case STATUS_BUS_VOLTAGE:
+        return device->bus_voltage;
+    case STATUS_TEMPERATURE:
+        return device->temperature;
+    case STATUS_POSITION:
+        return (uint32_t) device->position;
+    case STATUS_FAULT:
+        return device->fault;
+    case STATUS_MODE:
+        return device->mode;
+    case STATUS_OUTPUT_VOLTS:
+        return (uint16_t) ((int32_t) output_percent(device)
+                * device->bus_voltage / 32767);
+    default:
+        return 0;
+    }
+}
+
+static int status_size(uint8_t status_index)
+{
+    switch (status_index) {
+    case STATUS_POSITION:
+    case STATUS_SPEED:
+        return 4;
+    case STATUS_LIMIT:
+    case STATUS_FAULT:
+    case STATUS_MODE:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+// Byte of a status field selected by a periodic status layout code
+static uint8_t pstat_byte(JaguarSimDevice *device, uint8_t code)
+{
+    uint32_t value;
+    int byte;
+
+    if (code >= PSTAT_VOLTOUT_B0 && code <= PSTAT_VOLTOUT_B1) {
+        value = status_value(device, STATUS_OUTPUT_PERCENT);
+        byte = code - PSTAT_VOLTOUT_B0;
+    } else if (code >= PSTAT_VOLTBUS_B0 && code <= PSTAT_VOLTBUS_B1) {
+        value = status_value(device, STATUS_BUS_VOLTAGE);
+        byte = code - PSTAT_VOLTBUS_B0;
+    } else if (code >= PSTAT_TEMP_B0 && code <= PSTAT_TEMP_B1) {
+        value = status_value(device, STATUS_TEMPERATURE);
+        byte = code - PSTAT_TEMP_B0;
+    } else if (code >= PSTAT_POS_B0 && code <= PSTAT_POS_B3) {
+        value = status_value(device, STATUS_POSITION);
+        byte = code - PSTAT_POS_B0;
+    } else if (code >= PSTAT_VOUT_B0 && code <= PSTAT_VOUT_B1) {
+        value = status_value(device, STATUS_OUTPUT_VOLTS);
+        byte = code - PSTAT_VOUT_B0;
+    } else if (code == PSTAT_FAULT) {
+        value = device->fault;
+        byte = 0;
+    } else {
+        value = 0;
+        byte = 0;
+    }
+
+    return (uint8_t) (value >> (8 * byte));
+}
+
+// Answer a read with the current value followed by an ack, or apply a
+// write and ack it
+static void reply_or_set(JaguarSim *sim, CANMessage *message, uint32_t value,
+        int size, bool ack_reads)
+{
+    CANMessage reply;
+
+    if (message->data_size == 0) {
+        reply = *message;
+        if (size == 4) {
+            put32(&reply, value);
+        } else if (size == 2) {
+            put16(&reply, (uint16_t) value);
+        } else {
+            reply.data_size = 1;
+            reply.data[0] = (uint8_t) value;
+        }
+        send_frame(sim, &reply);
+        if (!ack_reads) {
+            return;
+        }
+    }
+    send_ack(sim, message->device);
+}
+
+static void handle_sys(JaguarSim *sim, CANMessage *message)
+{
+    JaguarSimDevice *device;
+    CANMessage reply;
+    int i;
+
+    if (message->api_index == SYS_SYNC_UPDATE && message->data_size < 1) {
+        // no group to update, the devices ignore it
+        return;
+    }
+
+    for (i = 1; i < JAGUAR_MAX_DEVICES; i++) {
+        device = &sim->device[i];
+        if (!device->present || (message->device != 0
+                && message->device != i)) {
+            continue;
+        }
+
+        switch (message->api_index) {
+        case SYS_HALT:
+            device->enabled = false;
+            break;
+        case SYS_RESET:
+            reset_device(device);
+            break;
+        case SYS_SYNC_UPDATE:
+            if (device->sync_group & message->data[0]) {
+                if (device->sync_class == API_VOLTAGE) {
+                    device->voltage = (int16_t) device->sync_value;
+                } else {
+                    device->position_target = device->sync_value;
+                    device->position = device->sync_value;
+                }
+                device->sync_group = 0;
+            }
+            break;
+        case SYS_ENUMERATION:
+            // devices answer one after another, ordered by device number
+            device->enumerate_us = jaguar_time_us() + (uint64_t) i * 1000;
+            break;
+        case SYS_FW_VER:
+            delay_frames(sim, sim->options.reply_latency_us);
+            reply = *message;
+            reply.device = (uint8_t) i;
+            put32(&reply, device->firmware_version);
+            send_frame(sim, &reply);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void handle_voltage(JaguarSim *sim, JaguarSimDevice *device,
+        CANMessage *message)
+{
+    switch (message->api_index) {
+    case VOLTAGE_ENABLE:
+        device->mode = STATUS_MODE_VOLTAGE;
+        device->enabled = true;
+        send_ack(sim, message->device);
+        break;
+    case VOLTAGE_DISABLE:
+        device->enabled = false;
+        send_ack(sim, message->device);
+        break;
+    case VOLTAGE_SET:
+        if (message->data_size == 3) {
+            device->sync_class = API_VOLTAGE;
+            device->sync_value = (int16_t) get16(message);
+            device->sync_group = message->data[2];
+        } else if (message->data_size == 2) {
+            device->voltage = (int16_t) get16(message);
+        }
+        reply_or_set(sim, message, (uint16_t) device->voltage, 2, true);
+        break;
+    case VOLTAGE_RAMP:
+        if (message->data_size == 2) {
+            device->voltage_ramp = get16(message);
+        }
+        reply_or_set(sim, message, device->voltage_ramp, 2, true);
+        break;
+    default:
+        send_ack(sim, message->device);
+        break;
+    }
+}
+
+static void handle_position(JaguarSim *sim, JaguarSimDevice *device,
+        CANMessage *message)
+{
+    int32_t *gain;
+
+    switch (message->api_index) {
+    case POSITION_ENABLE:
+        device->mode = STATUS_MODE_POSITION;
+        device->enabled = true;
+        if (message->data_size == 4) {
+            device->position = (int32_t) get32(message);
+            device->position_target = device->position;
+        }
+        send_ack(sim, message->device);
+        break;
+    case POSITION_DISABLE:
+        device->enabled = false;
+        send_ack(sim, message->device);
+        break;
+    case POSITION_SET:
+        if (message->data_size == 5) {
+            device->sync_class = API_POSITION;
+            device->sync_value = (int32_t) get32(message);
+            device->sync_group = message->data[4];
+        } else if (message->data_size == 4) {
+            // the simulated motor reaches its target at once
+            device->position_target = (int32_t) get32(message);
+            device->position = device->position_target;
+        }
+        reply_or_set(sim, message, (uint32_t) device->position_target, 4,
+                true);
+        break;
+    case POSITION_P:
+    case POSITION_I:
+    case POSITION_D:
+        if (message->api_index == POSITION_P) {
+            gain = &device->position_p;
+        } else if (message->api_index == POSITION_I) {
+            gain = &device->position_i;
+        } else {
+            gain = &device->position_d;
+        }
+        if (message->data_size == 4) {
+            *gain = (int32_t) get32(message);
+        }
+        reply_or_set(sim, message, (uint32_t) *gain, 4, true);
+        break;
+    case POSITION_REF:
+        if (message->data_size == 1) {
+            device->position_ref = message->data[0];
+        }
+        reply_or_set(sim, message, device->position_ref, 1, true);
+        break;
+    default:
+        send_ack(sim, message->device);
+        break;
+    }
+}
+
+static void handle_config(JaguarSim *sim, JaguarSimDevice *device,
+        CANMessage *message)
+{
+    switch (message->api_index) {
+    case CONFIG_ENCODER_LINES:
+        if (message->data_size == 2) {
+            device->encoder_lines = get16(message);
+        }
+        // reads of the encoder lines are not acknowledged
+        reply_or_set(sim, message, device->encoder_lines, 2, false);
+        break;
+    default:
+        reply_or_set(sim, message, 0, 2, false);
+        break;
+    }
+}
+
+static void handle_pstat(JaguarSim *sim, JaguarSimDevice *device,
+        CANMessage *message)
+{
+    uint8_t index;
+    int i;
+
+    if (message->api_index < PSTAT_CFG_S0) {
+        index = message->api_index - PSTAT_PER_EN_S0;
+        if (message->data_size == 2) {
+            device->pstat_period_ms[index] = get16(message);
+            device->pstat_next_us[index] = jaguar_time_us()
+                    + device->pstat_period_ms[index] * 1000;
+        }
+    } else if (message->api_index < PSTAT_DATA_S0) {
+        index = message->api_index - PSTAT_CFG_S0;
+        for (i = 0; i < message->data_size; i++) {
+            device->pstat_layout[index][i] = message->data[i];
+        }
+    }
+
+    send_ack(sim, message->device);
+}
+
+static void handle_message(JaguarSim *sim, CANMessage *message)
+{
+    JaguarSimDevice *device;
+    CANMessage reply;
+
+    sim->stats.frames_received += 1;
+
+    if (message->manufacturer == MANUFACTURER_SYS
+            && message->device_type == DEVTYPE_SYS) {
+        handle_sys(sim, message);
+        return;
+    }
+
+    device = &sim->device[message->device & 0x3F];
+    if (message->manufacturer != MANUFACTURER_TI
+            || message->device_type != DEVTYPE_MOTORCTRL
+            || !device->present) {
+        // nobody on the bus answers
+        return;
+    }
+
+    delay_frames(sim, sim->options.reply_latency_us);
+
+    switch (message->api_class) {
+    case API_VOLTAGE:
+        handle_voltage(sim, device, message);
+        break;
+    case API_POSITION:
+        handle_position(sim, device, message);
+        break;
+    case API_STATUS:
+        reply = *message;
+        put32(&reply, status_value(device, message->api_index));
+        reply.data_size = (uint8_t) status_size(message->api_index);
+        send_frame(sim, &reply);
+        send_ack(sim, message->device);
+        break;
+    case API_PSTAT:
+        handle_pstat(sim, device, message);
+        break;
+    case API_CONFIG:
+        handle_config(sim, device, message);
+        break;
+    default:
+        send_ack(sim, message->device);
+        break;
+    }
+}
+
+// Send the periodic status messages that are due, returns the time the
+// next one is due
+static uint64_t send_pstat(JaguarSim *sim, uint64_t now)
+{
+    JaguarSimDevice *device;
+    CANMessage message;
+    uint64_t next;
+    int i;
+    int n;
+    int b;
+
+    next = now + JAGSIM_TICK_US;
+    for (i = 1; i < JAGUAR_MAX_DEVICES; i++) {
+        device = &sim->device[i];
+        if (!device->present) {
+            continue;
+        }
+        for (n = 0; n < PSTAT_MESSAGES; n++) {
+            if (device->pstat_period_ms[n] == 0) {
+                continue;
+            }
+            if (device->pstat_next_us[n] <= now) {
+                init_jaguar_message(&message, API_PSTAT, PSTAT_DATA_S0 + n);
+                message.device = (uint8_t) i;
+                message.data_size = 0;
+                for (b = 0; b < MAX_DATA_BYTES
+                        && device->pstat_layout[n][b] != PSTAT_END; b++) {
+                    message.data[b] = pstat_byte(device,
+                            device->pstat_layout[n][b]);
+                    message.data_size += 1;
+                }
+                send_frame(sim, &message);
+                device->pstat_next_us[n] += device->pstat_period_ms[n] * 1000;
+                if (device->pstat_next_us[n] <= now) {
+                    // fell behind, skip the missed periods
+                    device->pstat_next_us[n] = now
+                            + device->pstat_period_ms[n] * 1000;
+                }
+            }
+            if (device->pstat_next_us[n] < next) {
+                next = device->pstat_next_us[n];
+            }
+        }
+    }
+
+    return next;
+}
+
+// Send the answers to an enumeration that are due, returns the time the 
+// next one is due
+static uint64_t send_enumeration(JaguarSim *sim, uint64_t now, uint64_t next)
+{
+    JaguarSimDevice *device;
+    CANMessage message;
+    int i;
+
+    for (i = 1; i < JAGUAR_MAX_DEVICES; i++) {
+        device = &sim->device[i];
+        if (!device->present || device->enumerate_us == 0) {
+            continue;
+        }
+        if (device->enumerate_us <= now) {
+            init_sys_message(&message, SYS_ENUMERATION);
+            message.device = (uint8_t) i;
+            message.data_size = 0;
+            send_frame(sim, &message);
+            device->enumerate_us = 0;
+        } else if (device->enumerate_us < next) {
+            next = device->enumerate_us;
+        }
+    }
+
+    return next;
+}
+
+static void *jaguar_sim_thread(void *arg)
+{
+    JaguarSim *sim;
+    CANMessage message;
+    CANMessage messages[JAGSIM_BATCH];
+    struct pollfd pfd[2];
+    uint8_t buffer[256];
+    uint64_t next;
+    uint64_t now;
+    size_t offset;
+    size_t consumed;
+    ssize_t bytes_read;
+    int result;
+    int count;
+    int errors;
+    int i;
+
+    sim = arg;
+    next = jaguar_time_us() + JAGSIM_TICK_US;
+    while (!sim->stop) {
+        now = jaguar_time_us();
+        pfd[0].fd = sim->bus != NULL ? sim->bus->serial_fd : sim->master_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = sim->wake_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        poll(pfd, 2, next > now ? (int) ((next - now + 999) / 1000) : 0);
+
+        if ((pfd[0].revents & POLLIN) && sim->bus != NULL) {
+            do {
+                pthread_mutex_lock(&sim->lock);
+                count = recieve_can_messages(sim->bus, messages,
+                        JAGSIM_BATCH, &errors);
+                for (i = 0; i < count; i++) {
+                    handle_message(sim, &messages[i]);
+                }
+                sim->stats.decode_errors += (uint64_t) errors;
+                pthread_mutex_unlock(&sim->lock);
+                flush_frames(sim);
+            } while (count == JAGSIM_BATCH);
+        } else if (pfd[0].revents & POLLIN) {
+            bytes_read = read(sim->master_fd, buffer, sizeof(buffer));
+            offset = 0;
+            pthread_mutex_lock(&sim->lock);
+            while (bytes_read > 0 && offset < (size_t) bytes_read) {
+                result = parse_can_bytes(&sim->parser, &buffer[offset],
+                        (size_t) bytes_read - offset, &consumed, &message);
+                offset += consumed;
+                if (result == PARSE_FRAME) {
+                    handle_message(sim, &message);
+                } else if (result == PARSE_ERROR) {
+                    sim->stats.decode_errors += 1;
+                }
+            }
+            pthread_mutex_unlock(&sim->lock);
+            flush_frames(sim);
+        }
+
+        pthread_mutex_lock(&sim->lock);
+        next = send_pstat(sim, jaguar_time_us());
+        next = send_enumeration(sim, jaguar_time_us(), next);
+        pthread_mutex_unlock(&sim->lock);
+        flush_frames(sim);
+    }
+
+    return NULL;
+}
+
+static void init_sim(JaguarSim *sim, int devices, JaguarSimOptions *options)
+{
+    int i;
+
+    memset(sim, 0, sizeof(JaguarSim));
+    if (options != NULL) {
+        sim->options = *options;
+    } else {
+        init_jaguar_sim_options(&sim->options);
+    }
+
+    // devices are numbered from 1, 0 is the broadcast address
+    for (i = 1; i < JAGUAR_MAX_DEVICES; i++) {
+        sim->device[i].present = i <= devices;
+        reset_device(&sim->device[i]);
+    }
+    init_frame_parser(&sim->parser);
+    sim->master_fd = -1;
+    sim->slave_fd = -1;
+}
+
+static int start_sim(JaguarSim *sim)
+{
+    sim->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->stop = false;
+    if (pthread_create(&sim->thread, NULL, jaguar_sim_thread, sim) != 0) {
+        close(sim->wake_fd);
+        pthread_mutex_destroy(&sim->lock);
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+int open_jaguar_sim(JaguarSim *sim, int devices, JaguarSimOptions *options)
+{
+    struct termios settings;
+
+    init_sim(sim, devices, options);
+
+    sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master_fd < 0) {
+        return JAGUAR_ERROR;
+    }
+    if (grantpt(sim->master_fd) != 0 || unlockpt(sim->master_fd) != 0
+            || ptsname_r(sim->master_fd, sim->port_name,
+                sizeof(sim->port_name)) != 0) {
+        close(sim->master_fd);
+        return JAGUAR_ERROR;
+    }
+
+    // hold the terminal open in raw mode so it keeps its settings and the
+    // bus does not hang up between connections
+    sim->slave_fd = open(sim->port_name, O_RDWR | O_NOCTTY);
+    if (sim->slave_fd < 0) {
+        close(sim->master_fd);
+        return JAGUAR_ERROR;
+    }
+    tcgetattr(sim->slave_fd, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(sim->slave_fd, TCSANOW, &settings);
+
+    if (start_sim(sim) != JAGUAR_OK) {
+        close(sim->slave_fd);
+        close(sim->master_fd);
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+// Simulate the devices on the far end of bus, a connection opened on any
+// transport, such as one end of a memory pair or a socket on vcan0. The
+// simulator receives and sends through bus, which stays owned by the
+// caller and is closed after the simulator.
+int open_jaguar_sim_bus(JaguarSim *sim, int devices, JaguarSimOptions *options,
+        JaguarConnection *bus)
+{
+    init_sim(sim, devices, options);
+    sim->bus = bus;
+
+    return start_sim(sim);
+}
+
+int close_jaguar_sim(JaguarSim *sim)
+{
+    uint64_t wakeup;
+
+    sim->stop = true;
+    wakeup = 1;
+    write(sim->wake_fd, &wakeup, sizeof(wakeup));
+    pthread_join(sim->thread, NULL);
+
+    close(sim->wake_fd);
+    if (sim->bus == NULL) {
+        close(sim->slave_fd);
+        close(sim->master_fd);
+    }
+    pthread_mutex_destroy(&sim->lock);
+
+    return JAGUAR_OK;
+}
+
+int set_jaguar_sim_options(JaguarSim *sim, JaguarSimOptions *options)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->options = *options;
+    pthread_mutex_unlock(&sim->lock);
+    return JAGUAR_OK;
+}
+
+int get_jaguar_sim_device(JaguarSim *sim, uint8_t device,
+        JaguarSimDevice *state)
+{
+    pthread_mutex_lock(&sim->lock);
+    *state = sim->device[device & 0x3F];
+    pthread_mutex_unlock(&sim->lock);
+    return JAGUAR_OK;
+}
+
+int get_jaguar_sim_stats(JaguarSim *sim, JaguarSimStats *stats)
+{
+    pthread_mutex_lock(&sim->lock);
+    *stats = sim->stats;
+    pthread_mutex_unlock(&sim->lock);
+    return JAGUAR_OK;
+}
@@ -0,0 +1,113 @@
+#ifndef JAGSIM_H
+#define JAGSIM_H
+
+#include "libjaguar.h"
+
+// Default simulated bus speed, bytes take 10 bit times on the wire
+#define JAGSIM_DEFAULT_BAUD 115200
+
+// Firmware version reported by every simulated device
+#define JAGSIM_FIRMWARE_VERSION 109
+
+// Frames the simulator can hold while handling what it received
+#define JAGSIM_OUTBOX 512
+
+// Simulated device state, values use the wire formats of the Jaguar api
+typedef struct JaguarSimDevice {
+    bool present;
+    uint8_t mode;
+    bool enabled;
+    int16_t voltage;
+    uint16_t voltage_ramp;
+    int32_t position;
+    int32_t position_target;
+    int32_t position_p;
+    int32_t position_i;
+    int32_t position_d;
+    uint8_t position_ref;
+    uint16_t encoder_lines;
+    uint16_t temperature;
+    uint16_t bus_voltage;
+    uint8_t fault;
+    uint32_t firmware_version;
+
+    // Time of the pending answer to an enumeration, 0 if none
+    uint64_t enumerate_us;
+
+    // Setpoints waiting for a sync update of their group
+    uint8_t sync_group;
+    uint8_t sync_class;
+    int32_t sync_value;
+
+    // Periodic status messages, a period of 0 is disabled
+    uint8_t pstat_layout[PSTAT_MESSAGES][MAX_DATA_BYTES];
+    uint16_t pstat_period_ms[PSTAT_MESSAGES];
+    uint64_t pstat_next_us[PSTAT_MESSAGES];
+} JaguarSimDevice;
+
+typedef struct JaguarSimOptions {
+    // Delay before a device answers a request, in microseconds
+    uint32_t reply_latency_us;
+    // Rate at which replies leave the simulator, 0 for unlimited
+    uint32_t baud;
+    // Probability of dropping or corrupting each sent byte, per million
+    uint32_t drop_ppm;
+    uint32_t corrupt_ppm;
+    unsigned int seed;
+} JaguarSimOptions;
+
+typedef struct JaguarSimStats {
+    uint64_t frames_received;
+    uint64_t frames_sent;
+    uint64_t bytes_sent;
+    uint64_t bytes_dropped;
+    uint64_t bytes_corrupted;
+    uint64_t decode_errors;
+} JaguarSimStats;
+
+// A frame the devices answered with, written once the simulator's lock is
+// released so the line time is not spent holding it. data holds what is
+// left of the encoded frame after losses, whole is false if any were lost.
+typedef struct JaguarSimFrame {
+    CANMessage message;
+    uint8_t data[MAX_MSG_BYTES];
+    uint8_t size;
+    bool whole;
+    // Wait before writing the frame, and line time it takes once written
+    uint32_t delay_us;
+    uint32_t wire_us;
+} JaguarSimFrame;
+
+// A simulated Jaguar bus behind a pseudo-terminal. Pass port_name to
+// open_jaguar_connection to talk to it. A simulator opened with
+// open_jaguar_sim_bus() talks through bus instead and has no port.
+typedef struct JaguarSim {
+    int master_fd;
+    int slave_fd;
+    int wake_fd;
+    char port_name[64];
+    JaguarConnection *bus;
+    JaguarSimOptions options;
+    JaguarSimDevice device[JAGUAR_MAX_DEVICES];
+    JaguarSimStats stats;
+    CANFrameParser parser;
+    JaguarSimFrame outbox[JAGSIM_OUTBOX];
+    int outbox_count;
+    uint32_t outbox_delay_us;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    volatile bool stop;
+} JaguarSim;
+
+int init_jaguar_sim_options(JaguarSimOptions *options);
+int open_jaguar_sim(JaguarSim *sim, int devices, JaguarSimOptions *options);
+int open_jaguar_sim_bus(JaguarSim *sim, int devices, JaguarSimOptions *options,
+        JaguarConnection *bus);
+int close_jaguar_sim(JaguarSim *sim);
+
+int set_jaguar_sim_options(JaguarSim *sim, JaguarSimOptions *options);
+int get_jaguar_sim_device(JaguarSim *sim, uint8_t device,
+        JaguarSimDevice *state);
+int get_jaguar_sim_stats(JaguarSim *sim, JaguarSimStats *stats);
+
+#endif
@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+
+#include "jagtransport.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+// Largest frame of any socket transport, a struct can_frame
+#define FRAME_BYTES 16
+
+// Smallest and largest datagram of the UDP transport
+#define DATAGRAM_MIN CAN_ID_SIZE
+#define DATAGRAM_MAX (CAN_ID_SIZE + MAX_DATA_BYTES)
+
+// Result of decoding one frame
+#define FRAME_OK      0
+#define FRAME_IGNORED 1
+#define FRAME_ERROR   2
+
+typedef size_t (*FrameEncoder)(CANMessage *message, uint8_t *bytes);
+typedef int (*FrameDecoder)(const uint8_t *bytes, size_t size,
+        CANMessage *message);
+
+// Frames read by the last fill, handed out one at a time by parse. errors
+// counts damaged frames not reported yet.
+typedef struct FrameBatch {
+    CANMessage frames[JAGUAR_SOCKET_BATCH];
+    int head;
+    int count;
+    int errors;
+} FrameBatch;
+
+typedef struct SocketTransport {
+    FrameEncoder encode;
+    FrameDecoder decode;
+    FrameBatch batch;
+} SocketTransport;
+
+// One direction of an in-memory pair. event_fd is readable while frames
+// may be waiting.
+typedef struct MemoryQueue {
+    CANMessage frames[JAGUAR_MEMORY_QUEUE];
+    uint32_t head;
+    uint32_t tail;
+    int event_fd;
+} MemoryQueue;
+
+// queue[i] holds the frames for end i, the pair is freed with its last end
+typedef struct MemoryPair {
+    pthread_mutex_t lock;
+    MemoryQueue queue[2];
+    bool open[2];
+} MemoryPair;
+
+typedef struct MemoryEnd {
+    MemoryPair *pair;
+    int side;
+    FrameBatch batch;
+} MemoryEnd;
+
+static int batch_parse(FrameBatch *batch, CANMessage *message)
+{
+    if (batch->errors > 0) {
+        batch->errors -= 1;
+        return PARSE_ERROR;
+    }
+    if (batch->head == batch->count) {
+        return PARSE_NEED_MORE;
+    }
+    *message = batch->frames[batch->head];
+    batch->head += 1;
+    return PARSE_FRAME;
+}
+
+// Send a batch of prepared datagrams or frames, waiting for room in the
+// socket's queue when it fills up. Each frame is sent whole or not at all.
+// Called with tx_lock held, so it gives up with JAGUAR_BUSY once the queue
+// has stayed full for timeout_us.
+static int send_all(int fd, struct mmsghdr *msgs, int count,
+        uint64_t timeout_us)
+{
+    struct pollfd pfd;
+    uint64_t deadline;
+    int sent;
+
+    deadline = jaguar_time_us() + timeout_us;
+    while (count > 0) {
+        sent = sendmmsg(fd, msgs, (unsigned int) count, 0);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ECONNREFUSED) {
+                // nobody is listening, the frame is lost as on an empty bus
+                msgs += 1;
+                count -= 1;
+                continue;
+            }
+            if (errno != EAGAIN && errno != ENOBUFS) {
+                return JAGUAR_ERROR;
+            }
+            if (jaguar_time_us() >= deadline) {
+                return JAGUAR_BUSY;
+            }
+            // a full CAN queue does not always report POLLOUT, retry soon
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            poll(&pfd, 1, 1);
+            continue;
+        }
+        msgs += sent;
+        count -= sent;
+    }
+
+    return JAGUAR_OK;
+}
+
+static int socket_send(JaguarConnection *conn, CANMessage *messages,
+        int count)
+{
+    SocketTransport *transport;
+    uint8_t bytes[JAGUAR_MAX_PENDING][FRAME_BYTES];
+    struct iovec iov[JAGUAR_MAX_PENDING];
+    struct mmsghdr msgs[JAGUAR_MAX_PENDING];
+    int result;
+    int batch;
+    int i;
+
+    transport = conn->transport_data;
+    for (; count > 0; count -= batch, messages += batch) {
+        batch = count > JAGUAR_MAX_PENDING ? JAGUAR_MAX_PENDING : count;
+        memset(msgs, 0, sizeof(struct mmsghdr) * (size_t) batch);
+        for (i = 0; i < batch; i++) {
+            iov[i].iov_base = bytes[i];
+            iov[i].iov_len = transport->encode(&messages[i], bytes[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        result = send_all(conn->serial_fd, msgs, batch, conn->timeout_us);
+        if (result != JAGUAR_OK) {
+            return result;
+        }
+    }
+
+    return JAGUAR_OK;
+}
+
+// Read up to a batch of frames with one system call
+static int socket_fill(JaguarConnection *conn)
+{
+    SocketTransport *transport;
+    FrameBatch *batch;
+    uint8_t bytes[JAGUAR_SOCKET_BATCH][FRAME_BYTES];
+    struct iovec iov[JAGUAR_SOCKET_BATCH];
+    struct mmsghdr msgs[JAGUAR_SOCKET_BATCH];
+    int received;
+    int filled;
+    int result;
+    int i;
+
+    transport = conn->transport_data;
+    batch = &transport->batch;
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < JAGUAR_SOCKET_BATCH; i++) {
+        iov[i].iov_base = bytes[i];
+        iov[i].iov_len = FRAME_BYTES;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    received = recvmmsg(conn->serial_fd, msgs, JAGUAR_SOCKET_BATCH,
+            MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED) {
+            return 0;
+        }
+        return -1;
+    }
+
+    batch->head = 0;
+    batch->count = 0;
+    filled = 0;
+    for (i = 0; i < received; i++) {
+        filled += (int) msgs[i].msg_len;
+        result = FRAME_ERROR;
+        if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            result = transport->decode(bytes[i], msgs[i].msg_len,
+                    &batch->frames[batch->count]);
+        }
+        if (result == FRAME_OK) {
+            batch->count += 1;
+        } else if (result == FRAME_ERROR) {
+            batch->errors += 1;
+        }
+    }
+
+    return filled;
+}
+
+static int socket_parse(JaguarConnection *conn, CANMessage *message)
+{
+    SocketTransport *transport;
+
+    transport = conn->transport_data;
+    return batch_parse(&transport->batch, message);
+}
+
+static void socket_close(JaguarConnection *conn)
+{
+    close(conn->serial_fd);
+    free(conn->transport_data);
+}
+
+// Set up a socket transport once its socket is bound
+static int open_socket_transport(JaguarConnection *conn, int fd,
+        const JaguarTransport *type, FrameEncoder encode,
+        FrameDecoder decode, uint32_t baud)
+{
+    SocketTransport *transport;
+
+    transport = calloc(1, sizeof(SocketTransport));
+    if (transport == NULL) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+    transport->encode = encode;
+    transport->decode = decode;
+
+    return open_jaguar_transport(conn, type, transport, fd, baud);
+}
+
+static size_t encode_can_frame(CANMessage *message, uint8_t *bytes)
+{
+    struct can_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = can_message_id(message) | CAN_EFF_FLAG;
+    frame.can_dlc = message->data_size;
+    memcpy(frame.data, message->data, message->data_size);
+    memcpy(bytes, &frame, sizeof(frame));
+
+    return sizeof(frame);
+}
+
+// Jaguar frames are extended data frames, anything else on the bus belongs
+// to other devices
+static int decode_can_frame(const uint8_t *bytes, size_t size,
+        CANMessage *message)
+{
+    struct can_frame frame;
+
+    if (size != sizeof(frame)) {
+        return FRAME_ERROR;
+    }
+    memcpy(&frame, bytes, sizeof(frame));
+    if (!(frame.can_id & CAN_EFF_FLAG)
+            || (frame.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))) {
+        return FRAME_IGNORED;
+    }
+    if (frame.can_dlc > MAX_DATA_BYTES) {
+        return FRAME_ERROR;
+    }
+
+    set_can_message_id(message, frame.can_id & CAN_EFF_MASK);
+    message->data_size = frame.can_dlc;
+    memset(message->data, 0, MAX_DATA_BYTES);
+    memcpy(message->data, frame.data, frame.can_dlc);
+
+    return FRAME_OK;
+}
+
+static const JaguarTransport socketcan_transport = {
+    "socketcan", socket_send, socket_fill, socket_parse, NULL, socket_close,
+    NULL
+};
+
+int open_jaguar_socketcan(JaguarConnection *conn, const char *interface)
+{
+    struct sockaddr_can addr;
+    struct can_filter filter;
+    struct ifreq ifr;
+    int fd;
+
+    conn->is_connected = false;
+    conn->serial_port = interface;
+    if (strlen(interface) >= IFNAMSIZ) {
+        return JAGUAR_ERROR;
+    }
+
+    fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (fd < 0) {
+        return JAGUAR_ERROR;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, interface);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+
+    // let the kernel drop standard and remote frames before they are read
+    filter.can_id = CAN_EFF_FLAG;
+    filter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+    if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, &filter,
+            sizeof(filter)) < 0) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+
+    return open_socket_transport(conn, fd, &socketcan_transport,
+            encode_can_frame, decode_can_frame, JAGUAR_CAN_BITRATE);
+}
+
+static size_t encode_datagram(CANMessage *message, uint8_t *bytes)
+{
+    uint32_t id;
+    int i;
+
+    id = can_message_id(message);
+    for (i = 0; i < CAN_ID_SIZE; i++) {
+        bytes[i] = (uint8_t) (id >> (8 * i));
+    }
+    memcpy(&bytes[CAN_ID_SIZE], message->data, message->data_size);
+
+    return CAN_ID_SIZE + message->data_size;
+}
+
+static int decode_datagram(const uint8_t *bytes, size_t size,
+        CANMessage *message)
+{
+    uint32_t id;
+    int i;
+
+    if (size < DATAGRAM_MIN || size > DATAGRAM_MAX) {
+        return FRAME_ERROR;
+    }
+
+    id = 0;
+    for (i = 0; i < CAN_ID_SIZE; i++) {
+        id |= (uint32_t) bytes[i] << (8 * i);
+    }
+    set_can_message_id(message, id);
+    message->data_size = (uint8_t) (size - CAN_ID_SIZE);
+    memset(message->data, 0, MAX_DATA_BYTES);
+    memcpy(message->data, &bytes[CAN_ID_SIZE], message->data_size);
+
+    return FRAME_OK;
+}
+
+static const JaguarTransport udp_transport = {
+    "udp", socket_send, socket_fill, socket_parse, NULL, socket_close,
+    NULL
+};
+
+int open_jaguar_udp(JaguarConnection *conn, uint16_t local_port,
+        uint16_t remote_port)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    conn->is_connected = false;
+    conn->serial_port = "udp";
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return JAGUAR_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(local_port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+    addr.sin_port = htons(remote_port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return JAGUAR_ERROR;
+    }
+
+    if (open_socket_transport(conn, fd, &udp_transport, encode_datagram,
+            decode_datagram, JAGUAR_HOST_BAUD) != JAGUAR_OK) {
+        return JAGUAR_ERROR;
+    }
+    conn->turnaround_us = 0;
+
+    return JAGUAR_OK;
+}
+
+static int memory_send(JaguarConnection *conn, CANMessage *messages,
+        int count)
+{
+    MemoryEnd *end;
+    MemoryQueue *queue;
+    uint64_t wakeup;
+    int result;
+    int i;
+
+    end = conn->transport_data;
+    queue = &end->pair->queue[1 - end->side];
+    result = JAGUAR_OK;
+
+    pthread_mutex_lock(&end->pair->lock);
+    if (end->pair->open[1 - end->side]) {
+        for (i = 0; i < count; i++) {
+            if (queue->tail - queue->head == JAGUAR_MEMORY_QUEUE) {
+                result = JAGUAR_ERROR;
+                break;
+            }
+            queue->frames[queue->tail % JAGUAR_MEMORY_QUEUE] = messages[i];
+            queue->tail += 1;
+        }
+    }
+    pthread_mutex_unlock(&end->pair->lock);
+
+    wakeup = 1;
+    write(queue->event_fd, &wakeup, sizeof(wakeup));
+
+    return result;
+}
+
+// Take a batch of frames from this end's queue. The event is cleared first,
+// so a frame queued meanwhile leaves it set for the next poll.
+static int memory_fill(JaguarConnection *conn)
+{
+    MemoryEnd *end;
+    MemoryQueue *queue;
+    FrameBatch *batch;
+    uint64_t wakeups;
+
+    end = conn->transport_data;
+    queue = &end->pair->queue[end->side];
+    batch = &end->batch;
+    read(queue->event_fd, &wakeups, sizeof(wakeups));
+
+    batch->head = 0;
+    batch->count = 0;
+    pthread_mutex_lock(&end->pair->lock);
+    while (queue->head != queue->tail && batch->count < JAGUAR_SOCKET_BATCH) {
+        batch->frames[batch->count] =
+                queue->frames[queue->head % JAGUAR_MEMORY_QUEUE];
+        batch->count += 1;
+        queue->head += 1;
+    }
+    if (queue->head != queue->tail) {
+        // more than a batch was waiting, stay readable
+        wakeups = 1;
+        write(queue->event_fd, &wakeups, sizeof(wakeups));
+    }
+    pthread_mutex_unlock(&end->pair->lock);
+
+    return batch->count * (int) sizeof(CANMessage);
+}
+
+static int memory_parse(JaguarConnection *conn, CANMessage *message)
+{
+    MemoryEnd *end;
+
+    end = conn->transport_data;
+    return batch_parse(&end->batch, message);
+}
+
+static void memory_close(JaguarConnection *conn)
+{
+    MemoryEnd *end;
+    MemoryPair *pair;
+    bool last;
+
+    end = conn->transport_data;
+    pair = end->pair;
+    pthread_mutex_lock(&pair->lock);
+    pair->open[end->side] = false;
+    last = !pair->open[1 - end->side];
+    pthread_mutex_unlock(&pair->lock);
+    free(end);
+
+    // the other end may still signal this end's event, keep both until the
+    // pair is done
+    if (last) {
+        close(pair->queue[0].event_fd);
+        close(pair->queue[1].event_fd);
+        pthread_mutex_destroy(&pair->lock);
+        free(pair);
+    }
+}
+
+static const JaguarTransport memory_transport = {
+    "memory", memory_send, memory_fill, memory_parse, NULL, memory_close,
+    NULL
+};
+
+int open_jaguar_memory_pair(JaguarConnection *a, JaguarConnection *b)
+{
+    MemoryPair *pair;
+    MemoryEnd *end[2];
+    JaguarConnection *conn[2];
+    int i;
+
+    a->is_connected = false;
+    b->is_connected = false;
+    pair = calloc(1, sizeof(MemoryPair));
+    end[0] = calloc(1, sizeof(MemoryEnd));
+    end[1] = calloc(1, sizeof(MemoryEnd));
+    if (pair == NULL || end[0] == NULL || end[1] == NULL) {
+        free(pair);
+        free(end[0]);
+        free(end[1]);
+        return JAGUAR_ERROR;
+    }
+
+    pair->queue[0].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pair->queue[1].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pair->queue[0].event_fd < 0 || pair->queue[1].event_fd < 0) {
+        close(pair->queue[0].event_fd);
+        close(pair->queue[1].event_fd);
+        free(pair);
+        free(end[0]);
+        free(end[1]);
+        return JAGUAR_ERROR;
+    }
+    pthread_mutex_init(&pair->lock, NULL);
+
+    conn[0] = a;
+    conn[1] = b;
+    for (i = 0; i < 2; i++) {
+        pair->open[i] = true;
+        end[i]->pair = pair;
+        end[i]->side = i;
+        conn[i]->serial_port = "memory";
+        open_jaguar_transport(conn[i], &memory_transport, end[i],
+                pair->queue[i].event_fd, JAGUAR_HOST_BAUD);
+        conn[i]->turnaround_us = 0;
+    }
+
+    return JAGUAR_OK;
+}
@@ -0,0 +1,36 @@
+#ifndef JAGTRANSPORT_H
+#define JAGTRANSPORT_H
+
+#include "libjaguar.h"
+
+// Bit rate of the CAN bus the controllers share. Over SocketCAN the bus
+// itself is the line the scheduler paces frames to.
+#define JAGUAR_CAN_BITRATE 1000000
+
+// Line rate assumed for transports that stay on the host, fast enough that
+// the scheduler never holds frames back
+#define JAGUAR_HOST_BAUD 100000000
+
+// Frames read with one system call, and taken from an in-memory queue at
+// once
+#define JAGUAR_SOCKET_BATCH 16
+
+// Frames waiting in each direction of an in-memory pair. Frames sent to a
+// full queue are lost, as on a bus nobody is reading.
+#define JAGUAR_MEMORY_QUEUE 256
+
+// Open a connection on a SocketCAN interface such as can0 or vcan0. Jaguar
+// identifiers are sent as extended frames, no serial bridge is involved.
+int open_jaguar_socketcan(JaguarConnection *conn, const char *interface);
+
+// Open a connection that sends one datagram per frame to remote_port on
+// the loopback interface and receives on local_port. A datagram holds the
+// little endian 29-bit identifier followed by the data bytes.
+int open_jaguar_udp(JaguarConnection *conn, uint16_t local_port,
+        uint16_t remote_port);
+
+// Open two connections wired to each other in memory, what one sends the
+// other receives. Each end is closed with close_jaguar_connection().
+int open_jaguar_memory_pair(JaguarConnection *a, JaguarConnection *b);
+
+#endif
@@ -1,20 +1,243 @@
+#define _GNU_SOURCE
+
 #include "libjaguar.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <linux/futex.h>
+#include <linux/serial.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+// Share of the line each class may use ahead of less urgent classes, in 
+// percent. Safety and heartbeat frames are never held back.
+static const uint8_t default_class_share[JAGUAR_CLASSES] = {
+    100, 100, 50, 20, 30
+};
+
+static const JaguarTransport serial_transport;
+
+// termios speed for a line rate, B0 if the rate is not a standard one
+static speed_t baud_speed(uint32_t baud)
+{
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    case 3000000: return B3000000;
+    default: return B0;
+    }
+}
+
+// Ask the serial driver to hand received bytes to the tty layer at once. 
+// Ptys and some USB drivers have no such flag, they are left alone.
+static void set_low_latency(int fd)
+{
+    struct serial_struct serial;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+        return;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &serial);
+}
+
+// Set the receive latency timer of a USB serial adapter, the time it holds 
+// bytes in its FIFO waiting for more before sending them to the host. Only 
+// adapters that expose it in sysfs, such as FTDI ones, are changed.
+static void set_latency_timer(const char *serial_port, uint8_t timer_ms)
+{
+    char device[PATH_MAX];
+    char path[PATH_MAX + 64];
+    FILE *file;
+
+    if (realpath(serial_port, device) == NULL) {
+        return;
+    }
+    snprintf(path, sizeof(path), 
+            "/sys/bus/usb-serial/devices/%s/latency_timer", basename(device));
+    file = fopen(path, "w");
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "%u\n", timer_ms);
+    fclose(file);
+}
+
+int init_jaguar_serial_options(JaguarSerialOptions *options)
+{
+    options->baud = JAGUAR_DEFAULT_BAUD;
+    return set_jaguar_serial_profile(options, JAGUAR_PROFILE_DEFAULT);
+}
+
+// Fill in the options of a predefined profile, keeping the line rate. The 
+// default profile leaves the port as the driver set it up. Low latency 
+// turns off the buffering in the driver and the USB adapter, spin also 
+// keeps the waiting thread reading for a reply's worth of line time.
+int set_jaguar_serial_profile(JaguarSerialOptions *options, int profile)
+{
+    options->low_latency = false;
+    options->latency_timer_ms = 0;
+    options->read_strategy = JAGUAR_READ_POLL;
+    options->spin_us = 0;
+    options->tx_drain = JAGUAR_DRAIN_NONE;
+
+    switch (profile) {
+    case JAGUAR_PROFILE_DEFAULT:
+        break;
+    case JAGUAR_PROFILE_LOW_LATENCY:
+        options->low_latency = true;
+        options->latency_timer_ms = 1;
+        break;
+    case JAGUAR_PROFILE_SPIN:
+        options->low_latency = true;
+        options->latency_timer_ms = 1;
+        options->read_strategy = JAGUAR_READ_SPIN;
+        options->spin_us = 2000;
+        break;
+    default:
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
 int open_jaguar_connection(JaguarConnection *conn, const char *serial_port)
+{
+    JaguarSerialOptions options;
+
+    init_jaguar_serial_options(&options);
+    return open_jaguar_connection_options(conn, serial_port, &options);
+}
+
+// Set up a connection whose transport receives on fd. Transports call this 
+// once their fd is open, it never fails. baud is the line rate the bus 
+// scheduler paces frames to.
+int open_jaguar_transport(JaguarConnection *conn, 
+        const JaguarTransport *transport, void *data, int fd, uint32_t baud)
+{
+    int i;
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+
+    conn->transport = transport;
+    conn->transport_data = data;
+    conn->serial_fd = fd;
+    conn->is_connected = true;
+    conn->timeout_us = JAGUAR_DEFAULT_TIMEOUT_US;
+    conn->pending_count = 0;
+
+    // reset receive buffer
+    conn->rx_head = 0;
+    conn->rx_tail = 0;
+    init_frame_parser(&conn->rx_parser);
+    conn->tx_head = 0;
+    conn->tx_tail = 0;
+    conn->saved_settings = NULL;
+
+    // empty dispatch table, pages are allocated as handlers are registered
+    for (i = 0; i < DISPATCH_PAGES; i++) {
+        conn->dispatch[i] = NULL;
+    }
+    conn->default_handler = NULL;
+    conn->dispatch_epoch = 0;
+    conn->dispatch_readers[0] = 0;
+    conn->dispatch_readers[1] = 0;
+
+    memset(conn->telemetry, 0, sizeof(conn->telemetry));
+    memset(conn->devices, 0, sizeof(conn->devices));
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    memset(conn->device_stats, 0, sizeof(conn->device_stats));
+    memset(conn->pstat_layout, PSTAT_END, sizeof(conn->pstat_layout));
+
+    // registration may nest, see wait_jaguar_message()
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&conn->dispatch_lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    // waits use the same monotonic clock as transaction deadlines
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&conn->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_mutex_init(&conn->tx_lock, NULL);
+
+    conn->heartbeat_fd = -1;
+    conn->heartbeat_stop = false;
+
+    init_jaguar_serial_options(&conn->serial_options);
+    conn->serial_options.baud = baud;
+    conn->baud = baud;
+    conn->turnaround_us = JAGUAR_SCHED_TURNAROUND_US;
+    conn->line_free_us = 0;
+    conn->budget_updated_us = jaguar_time_us();
+    conn->schedule_us = 0;
+    for (i = 0; i < JAGUAR_CLASSES; i++) {
+        conn->class_head[i] = NULL;
+        conn->class_tail[i] = NULL;
+        conn->class_share[i] = default_class_share[i];
+        conn->class_budget_us[i] = JAGUAR_SCHED_BURST_US;
+    }
+
+    conn->io_running = false;
+    conn->io_stop = false;
+    conn->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    conn->loop = NULL;
+    conn->submissions = NULL;
+    conn->completed = NULL;
+    conn->completions = 0;
+    conn->sleepers = 0;
+    conn->tap = NULL;
+    conn->tap_context = NULL;
+    conn->tap_users = 0;
+    conn->trace = NULL;
+
+    return 0;
+}
+
+int open_jaguar_connection_options(JaguarConnection *conn, 
+        const char *serial_port, const JaguarSerialOptions *options)
 {
     int fd;
+    speed_t speed;
     struct termios settings;
     conn->is_connected = false;
     conn->serial_port = serial_port;
 
+    speed = baud_speed(options->baud);
+    if (speed == B0) {
+        return 1;
+    }
+
     // open serial port
     fd = open(serial_port, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (fd < 0) {
         // could not open serial port
         return 1;
     }
-    conn->serial_fd = fd;
-    conn->is_connected = true;
+    open_jaguar_transport(conn, &serial_transport, NULL, fd, options->baud);
+    conn->serial_options = *options;
 
     conn->saved_settings = malloc(sizeof(struct termios));
 
@@ -24,16 +247,28 @@ int open_jaguar_connection(JaguarConnection *conn, const char *serial_port)
     // initialize new settings with existing settings
     tcgetattr(fd, &settings);
 
-    // set baud rate to 115200
-    cfsetispeed(&settings, B115200);
-    cfsetospeed(&settings, B115200);
+    // set baud rate
+    cfsetispeed(&settings, speed);
+    cfsetospeed(&settings, speed);
 
     // set port to raw mode
     cfmakeraw(&settings);
 
+    // reads return whatever is buffered and never block, waiting is done 
+    // with poll so it can also watch the wakeup and heartbeat timers
+    settings.c_cc[VMIN] = 0;
+    settings.c_cc[VTIME] = 0;
+
     // apply settings
     tcsetattr(fd, TCSANOW, &settings);
 
+    if (options->low_latency) {
+        set_low_latency(fd);
+    }
+    if (options->latency_timer_ms > 0) {
+        set_latency_timer(serial_port, options->latency_timer_ms);
+    }
+
     // flush buffers
     tcflush(fd, TCIOFLUSH);
 
@@ -42,364 +277,3821 @@ int open_jaguar_connection(JaguarConnection *conn, const char *serial_port)
 
 int close_jaguar_connection(JaguarConnection *conn)
 {
-    int fd;
+    int i;
+
+    if (conn->loop != NULL) {
+        remove_jaguar_loop_connection(conn->loop, conn);
+    }
+    if (conn->io_running) {
+        stop_jaguar_io_thread(conn);
+    }
+    stop_jaguar_heartbeat(conn);
     conn->is_connected = false;
 
-    fd = conn->serial_fd;
+    conn->transport->close(conn);
 
-    // flush buffers
-    tcflush(fd, TCIOFLUSH);
+    for (i = 0; i < DISPATCH_PAGES; i++) {
+        free(conn->dispatch[i]);
+        conn->dispatch[i] = NULL;
+    }
+    close(conn->wake_fd);
+    if (conn->trace != NULL) {
+        if (conn->trace->dump != NULL) {
+            munmap(conn->trace->dump, conn->trace->dump_size);
+        }
+        free(conn->trace);
+        conn->trace = NULL;
+    }
+    pthread_mutex_destroy(&conn->dispatch_lock);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->tx_lock);
+    pthread_cond_destroy(&conn->cond);
 
-    // apply saved settings
-    tcsetattr(fd, TCSANOW, conn->saved_settings);
+    return 0;
+}
 
-    // free memory for saved settings
-    free(conn->saved_settings);
+int set_jaguar_timeout(JaguarConnection *conn, uint32_t timeout_us)
+{
+    conn->timeout_us = timeout_us;
+    return 0;
+}
 
-    // close serial port
-    close(fd);
+uint64_t jaguar_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
 
-    return 0;
+// Statistics are updated with relaxed atomic adds so the send and receive 
+// paths never take a lock for them
+static inline void count_stat(uint64_t *counter, uint64_t amount)
+{
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
 }
 
-int send_can_message(JaguarConnection *conn, CANMessage *message)
+// Timestamp of a trace record, the TSC where there is one since it reads 
+// in a few nanoseconds
+static inline uint64_t trace_clock(void)
 {
-    CANEncodedMsg encoded_message;
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+#endif
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
 
-    encode_can_message(message, &encoded_message);
-    write(conn->serial_fd, encoded_message.data, encoded_message.size);
-    // Sleep to allow message to send before proceding
-    usleep(1);
+// Append an event to the trace ring if tracing is on. The slot is claimed 
+// with one atomic add, its seq is cleared while the record is written and 
+// set once it is complete, so dumps skip records being overwritten.
+static inline void trace_event(JaguarConnection *conn, uint8_t event, 
+        uint32_t id, uint32_t value, int status)
+{
+    JaguarTrace *trace;
+    JaguarTraceRecord *record;
+    uint64_t index;
 
-    return 0;
+    trace = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL || !__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    index = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    record = &trace->records[index & (JAGUAR_TRACE_RECORDS - 1)];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->time = trace_clock();
+    record->id = id;
+    record->value = value;
+    record->event = event;
+    record->status = (uint8_t) status;
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
 }
 
-int recieve_can_message(JaguarConnection *conn, CANMessage *message)
+static inline void trace_frame(JaguarConnection *conn, uint8_t event, 
+        CANMessage *message)
 {
-    int fd;
-    int bytes_read;
-    int extra_bytes;
-    uint8_t read_byte;
-    uint8_t size;
-    uint8_t *data_ptr;
-    CANEncodedMsg encoded_message;
+    if (__atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE) != NULL) {
+        trace_event(conn, event, can_message_id(message), 
+                message->data_size, 0);
+    }
+}
 
-    fd = conn->serial_fd;
+// Dump the trace after a decode error if asked to, or after a timeout once 
+// the connection lock is released, see flush_trace_fault(). Copying the 
+// ring takes too long to do with the lock held.
+static void trace_fault(JaguarConnection *conn, bool locked)
+{
+    JaguarTrace *trace;
+
+    trace = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL || !trace->dump_on_fault 
+            || !__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (locked) {
+        __atomic_store_n(&trace->fault, 1, __ATOMIC_RELEASE);
+    } else {
+        dump_jaguar_trace(conn);
+    }
+}
+
+// Dump the trace for a timeout recorded with the connection lock held
+static void flush_trace_fault(JaguarConnection *conn)
+{
+    JaguarTrace *trace;
+
+    trace = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (trace != NULL && __atomic_load_n(&trace->fault, __ATOMIC_RELAXED) 
+            && __atomic_exchange_n(&trace->fault, 0, __ATOMIC_ACQUIRE)) {
+        dump_jaguar_trace(conn);
+    }
+}
+
+static void record_latency(JaguarLatency *latency, uint64_t latency_us)
+{
+    uint64_t max;
+    int bucket;
+
+    bucket = latency_us == 0 ? 0 : 64 - __builtin_clzll(latency_us);
+    if (bucket >= JAGUAR_LATENCY_BUCKETS) {
+        bucket = JAGUAR_LATENCY_BUCKETS - 1;
+    }
+    count_stat(&latency->count, 1);
+    count_stat(&latency->total_us, latency_us);
+    count_stat(&latency->buckets[bucket], 1);
+
+    max = __atomic_load_n(&latency->max_us, __ATOMIC_RELAXED);
+    while (latency_us > max && !__atomic_compare_exchange_n(
+            &latency->max_us, &max, latency_us, true, 
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // max was reloaded, try again
+    }
+}
+
+// Time a frame of the given encoded size holds the line, each byte takes a 
+// start bit, 8 data bits and a stop bit
+static uint32_t wire_time_us(JaguarConnection *conn, size_t encoded_size)
+{
+    return (uint32_t) (((uint64_t) encoded_size * 10 * 1000000 + conn->baud 
+            - 1) / conn->baud);
+}
+
+// Bytes the serial encoding of a message spends on escapes, each special 
+// byte of the identifier or data takes two bytes
+static int escaped_bytes(CANMessage *message)
+{
+    uint32_t id;
+    int escaped;
+    int i;
 
-    // discard bytes or wait until start of frame read
-    read(fd, &read_byte, 1);
-    while(read_byte != START_OF_FRAME) {
-        read(fd, &read_byte, 1);
+    escaped = 0;
+    id = can_message_id(message);
+    for (i = 0; i < CAN_ID_SIZE; i++) {
+        escaped += ((id >> (8 * i) & 0xFF) | 1) == START_OF_FRAME;
+    }
+    for (i = 0; i < message->data_size; i++) {
+        escaped += (message->data[i] | 1) == START_OF_FRAME;
     }
 
-    bytes_read = 0;
-    encoded_message.data[0] = START_OF_FRAME;
+    return escaped;
+}
+
+// Size of a message in the serial encoding. The line model and the 
+// traffic counters use it whatever the transport, with the transport's 
+// line rate setting the scale.
+static uint8_t encoded_size(CANMessage *message)
+{
+    return (uint8_t) (HEADER_SIZE + message->data_size 
+            + escaped_bytes(message));
+}
+
+uint32_t estimate_wire_time_us(JaguarConnection *conn, CANMessage *message)
+{
+    return wire_time_us(conn, encoded_size(message));
+}
 
-    read(fd, &size, 1);
-    encoded_message.data[1] = size;
+// Scheduler class of a message, see JAGUAR_CLASS_
+int get_jaguar_class(CANMessage *message)
+{
+    if (message->manufacturer == MANUFACTURER_SYS) {
+        switch (message->api_index) {
+        case SYS_HALT:
+        case SYS_RESET:
+        case SYS_RESUME:
+            return JAGUAR_CLASS_SAFETY;
+        case SYS_HEARTBEAT:
+            return JAGUAR_CLASS_HEARTBEAT;
+        case SYS_SYNC_UPDATE:
+            return JAGUAR_CLASS_SETPOINT;
+        default:
+            return JAGUAR_CLASS_CONFIG;
+        }
+    }
 
-    // read bytes into encoded message buffer
-    data_ptr = &(encoded_message.data[2]);
-    for(bytes_read = 0; bytes_read < size; bytes_read++) {
-        read(fd, data_ptr, 1);
-        if (*data_ptr == ENCODE_BYTE_A){
-            // read the second encoded byte
-            data_ptr += 1;
-            read(fd, data_ptr, 1);
-            extra_bytes += 1;
+    switch (message->api_class) {
+    case API_VOLTAGE:
+    case API_SPEED:
+    case API_VOLTCOMP:
+    case API_POSITION:
+    case API_CURRENT:
+        if (message->api_index == VOLTAGE_DISABLE) {
+            // every control mode numbers disable alike
+            return JAGUAR_CLASS_SAFETY;
+        }
+        if (message->api_index == VOLTAGE_ENABLE) {
+            return JAGUAR_CLASS_SETPOINT;
+        }
+        if (message->api_index == VOLTAGE_SET) {
+            // a set without data reads the setpoint back
+            return message->data_size != 0 
+                    ? JAGUAR_CLASS_SETPOINT : JAGUAR_CLASS_TELEMETRY;
         }
-        data_ptr += 1;
+        return JAGUAR_CLASS_CONFIG;
+    case API_STATUS:
+        return JAGUAR_CLASS_TELEMETRY;
+    default:
+        return JAGUAR_CLASS_CONFIG;
     }
+}
 
-    encoded_message.size = 2 + size + extra_bytes;
+// Account for bytes handed to the port, they hold the line after whatever 
+// was handed to it before. Called with tx_lock held.
+static void occupy_line(JaguarConnection *conn, size_t size)
+{
+    uint64_t now;
 
-    decode_can_message(&encoded_message, message);
+    now = jaguar_time_us();
+    if (conn->line_free_us < now) {
+        conn->line_free_us = now;
+    }
+    conn->line_free_us += wire_time_us(conn, size);
+}
 
-    usleep(1);
+static void count_sent(JaguarConnection *conn, CANMessage *message, 
+        uint8_t encoded_size)
+{
+    int traffic_class;
 
-    return 0;
+    traffic_class = get_jaguar_class(message);
+    count_stat(&conn->stats.class_frames_sent[traffic_class], 1);
+    count_stat(&conn->stats.class_wire_us[traffic_class], 
+            wire_time_us(conn, encoded_size));
+    count_stat(&conn->stats.frames_sent, 1);
+    count_stat(&conn->stats.bytes_sent, encoded_size);
+    count_stat(&conn->stats.escape_bytes_sent, 
+            encoded_size - HEADER_SIZE - message->data_size);
+    count_stat(&conn->device_stats[message->device & 0x3F].frames_sent, 1);
 }
 
-int init_sys_message(CANMessage *message, uint8_t api_index)
+static void count_received(JaguarConnection *conn, CANMessage *message)
 {
-    message->manufacturer = MANUFACTURER_SYS;
-    message->device_type = DEVTYPE_SYS;
-    message->api_class = API_SYS;
-    message->api_index = api_index;
-    return 0;
+    count_stat(&conn->stats.frames_received, 1);
+    count_stat(&conn->stats.escape_bytes_received, 
+            (uint64_t) escaped_bytes(message));
+    count_stat(&conn->device_stats[message->device & 0x3F].frames_received, 
+            1);
 }
 
-int init_jaguar_message(CANMessage *message, uint8_t api_class, uint8_t api_index)
+// Serial transport: frames are escaped and sent to the serial bridge, and 
+// received bytes are buffered until a whole frame can be parsed
+
+// Write as much of the transmit ring as the port takes with one writev, 
+// without waiting. A short write or EAGAIN means the output queue is full, 
+// the rest stays in the ring until the port is writable again.
+static int serial_flush(JaguarConnection *conn)
 {
-    message->manufacturer = MANUFACTURER_TI;
-    message->device_type = DEVTYPE_MOTORCTRL;
-    message->api_class = api_class;
-    message->api_index = api_index;
-    return 0;
+    uint32_t used;
+    uint32_t head;
+    struct iovec iov[2];
+    int iov_count;
+    ssize_t written;
+
+    used = conn->tx_tail - conn->tx_head;
+    if (used == 0) {
+        return JAGUAR_OK;
+    }
+
+    head = conn->tx_head & (TX_BUFFER_SIZE - 1);
+    iov[0].iov_base = &(conn->tx_buffer[head]);
+    if (head + used <= TX_BUFFER_SIZE) {
+        iov[0].iov_len = used;
+        iov_count = 1;
+    } else {
+        // queued bytes wrap around the end of the ring
+        iov[0].iov_len = TX_BUFFER_SIZE - head;
+        iov[1].iov_base = conn->tx_buffer;
+        iov[1].iov_len = used - iov[0].iov_len;
+        iov_count = 2;
+    }
+
+    do {
+        written = writev(conn->serial_fd, iov, iov_count);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        if (errno == EAGAIN) {
+            return JAGUAR_OK;
+        }
+        // the port failed, what was queued is lost with it
+        __atomic_store_n(&conn->tx_head, conn->tx_tail, __ATOMIC_RELAXED);
+        return JAGUAR_ERROR;
+    }
+
+    __atomic_store_n(&conn->tx_head, conn->tx_head + (uint32_t) written, 
+            __ATOMIC_RELAXED);
+    return JAGUAR_OK;
 }
 
-bool valid_sys_reply(CANMessage *message, CANMessage *reply)
+// With JAGUAR_DRAIN_WAIT, write out the whole ring and wait until the 
+// port has sent it. Gives up on a port that takes nothing for a timeout.
+static void serial_drain(JaguarConnection *conn)
 {
-    return reply->manufacturer == MANUFACTURER_SYS
-            && reply->device_type == DEVTYPE_SYS
-            && reply->api_class == API_SYS
-            && reply->api_index == message->api_index
-            && reply->device == message->device;
+    struct pollfd pfd;
+
+    if (conn->serial_options.tx_drain != JAGUAR_DRAIN_WAIT) {
+        return;
+    }
+    while (conn->tx_tail != conn->tx_head) {
+        pfd.fd = conn->serial_fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, conn->timeout_us / 1000 + 1) <= 0 
+                || serial_flush(conn) != JAGUAR_OK) {
+            break;
+        }
+    }
+    tcdrain(conn->serial_fd);
 }
 
-bool valid_jaguar_reply(CANMessage *message, CANMessage *reply)
+// Encode messages straight into the transmit ring and hand everything 
+// queued to the port with one writev, so frames sent back to back leave 
+// together. Never waits for the port: what it cannot take yet stays in 
+// the ring, see drain_tx(). Either every message is queued or, with 
+// JAGUAR_BUSY when the ring has no room for them, none is.
+static int serial_send(JaguarConnection *conn, CANMessage *messages, 
+        int count)
 {
-    return reply->manufacturer == MANUFACTURER_TI 
-            && reply->device_type == DEVTYPE_MOTORCTRL
-            && reply->api_class == message->api_class
-            && reply->api_index == message->api_index
-            && reply->device == message->device;
+    CANEncodedMsg encoded_message;
+    uint32_t tail;
+    uint32_t part;
+    size_t needed;
+    size_t size;
+    int result;
+    int i;
+
+    needed = 0;
+    for (i = 0; i < count; i++) {
+        if (messages[i].data_size > MAX_DATA_BYTES) {
+            return JAGUAR_ERROR;
+        }
+        needed += encoded_size(&messages[i]);
+    }
+    if (needed > TX_BUFFER_SIZE) {
+        return JAGUAR_ERROR;
+    }
+    if (TX_BUFFER_SIZE - (conn->tx_tail - conn->tx_head) < needed) {
+        // the port may have taken more since the last write
+        serial_flush(conn);
+        if (TX_BUFFER_SIZE - (conn->tx_tail - conn->tx_head) < needed) {
+            return JAGUAR_BUSY;
+        }
+    }
+
+    result = JAGUAR_OK;
+    for (i = 0; i < count; i++) {
+        tail = conn->tx_tail & (TX_BUFFER_SIZE - 1);
+        if (TX_BUFFER_SIZE - tail >= MAX_MSG_BYTES) {
+            encode_can_bytes(&messages[i], &conn->tx_buffer[tail], &size);
+        } else {
+            // the frame wraps around the end of the ring
+            encode_can_message(&messages[i], &encoded_message);
+            size = encoded_message.size;
+            part = TX_BUFFER_SIZE - tail;
+            if (part > size) {
+                part = (uint32_t) size;
+            }
+            memcpy(&conn->tx_buffer[tail], encoded_message.data, part);
+            memcpy(conn->tx_buffer, &encoded_message.data[part], size - part);
+        }
+        __atomic_store_n(&conn->tx_tail, conn->tx_tail + (uint32_t) size, 
+                __ATOMIC_RELAXED);
+    }
+
+    if (serial_flush(conn) != JAGUAR_OK) {
+        result = JAGUAR_ERROR;
+    }
+
+    return result;
 }
 
-bool valid_ack(CANMessage *message, CANMessage *ack)
+// Read whatever bytes are available into the free space of the receive 
+// buffer with a single system call
+static int serial_fill(JaguarConnection *conn)
 {
-    return ack->manufacturer == MANUFACTURER_TI 
-            && ack->device_type == DEVTYPE_MOTORCTRL
-            && ack->api_class == API_ACK
-            && ack->device == message->device;
+    uint32_t used;
+    uint32_t free_bytes;
+    uint32_t tail;
+    struct iovec iov[2];
+    int iov_count;
+    ssize_t bytes_read;
+
+    used = conn->rx_tail - conn->rx_head;
+    free_bytes = RX_BUFFER_SIZE - used;
+    if (free_bytes == 0) {
+        return 0;
+    }
+
+    tail = conn->rx_tail & (RX_BUFFER_SIZE - 1);
+    iov[0].iov_base = &(conn->rx_buffer[tail]);
+    if (tail + free_bytes <= RX_BUFFER_SIZE) {
+        iov[0].iov_len = free_bytes;
+        iov_count = 1;
+    } else {
+        // free space wraps around the end of the buffer
+        iov[0].iov_len = RX_BUFFER_SIZE - tail;
+        iov[1].iov_base = conn->rx_buffer;
+        iov[1].iov_len = free_bytes - iov[0].iov_len;
+        iov_count = 2;
+    }
+
+    bytes_read = readv(conn->serial_fd, iov, iov_count);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    conn->rx_tail += (uint32_t) bytes_read;
+    return (int) bytes_read;
 }
 
-int sys_heartbeat(JaguarConnection *conn, uint8_t device)
+// Parse the next complete message out of the receive buffer
+static int serial_parse(JaguarConnection *conn, CANMessage *message)
 {
-    CANMessage message;
-    init_sys_message(&message, SYS_HEARTBEAT);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
+    uint32_t head;
+    uint32_t size;
+    size_t consumed;
+    int result;
 
-    return 0;
+    while (conn->rx_head != conn->rx_tail) {
+        // parse the contiguous run of bytes up to the end of the buffer
+        head = conn->rx_head & (RX_BUFFER_SIZE - 1);
+        size = conn->rx_tail - conn->rx_head;
+        if (head + size > RX_BUFFER_SIZE) {
+            size = RX_BUFFER_SIZE - head;
+        }
+
+        result = parse_can_bytes(&conn->rx_parser, &(conn->rx_buffer[head]),
+                size, &consumed, message);
+        conn->rx_head += (uint32_t) consumed;
+        if (result != PARSE_NEED_MORE) {
+            return result;
+        }
+    }
+
+    return PARSE_NEED_MORE;
 }
 
-int sys_sync_update(JaguarConnection *conn, uint8_t mask)
+static void serial_close(JaguarConnection *conn)
 {
-    CANMessage message;
-    init_sys_message(&message, SYS_SYNC_UPDATE);
-    message.device = 0;
-    message.data_size = 1;
-    message.data[0] = mask;
-    send_can_message(conn, &message);
+    int fd;
 
-    return 0;
+    fd = conn->serial_fd;
+
+    // flush buffers
+    tcflush(fd, TCIOFLUSH);
+
+    // apply saved settings
+    tcsetattr(fd, TCSANOW, conn->saved_settings);
+
+    // free memory for saved settings
+    free(conn->saved_settings);
+
+    // close serial port
+    close(fd);
 }
 
-int sys_halt(JaguarConnection *conn, uint8_t device)
+static const JaguarTransport serial_transport = {
+    "serial", serial_send, serial_fill, serial_parse, serial_drain, 
+    serial_close, serial_flush
+};
+
+// Pass a frame to the tap, if one is set. The user count lets 
+// set_jaguar_tap() wait for threads still inside the old tap.
+static inline void tap_frame(JaguarConnection *conn, int direction, 
+        CANMessage *message)
 {
-    CANMessage message;
-    init_sys_message(&message, SYS_HALT);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
+    JaguarTap tap;
 
-    return 0;
+    if (__atomic_load_n(&conn->tap, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    __atomic_add_fetch(&conn->tap_users, 1, __ATOMIC_SEQ_CST);
+    tap = __atomic_load_n(&conn->tap, __ATOMIC_SEQ_CST);
+    if (tap != NULL) {
+        tap(conn, direction, message, conn->tap_context);
+    }
+    __atomic_sub_fetch(&conn->tap_users, 1, __ATOMIC_RELEASE);
 }
 
-int sys_reset(JaguarConnection *conn, uint8_t device)
+// True while encoded bytes wait in the transmit ring for the port
+static inline bool tx_queued(JaguarConnection *conn)
 {
-    CANMessage message;
-    init_sys_message(&message, SYS_RESET);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
+    return __atomic_load_n(&conn->tx_head, __ATOMIC_RELAXED) 
+            != __atomic_load_n(&conn->tx_tail, __ATOMIC_RELAXED);
+}
 
-    return 0;
+// Apply the transport's drain policy after a write, with tx_lock held. 
+// Bytes the port could not take yet stay in the ring and never block the 
+// caller: the owner of the connection is woken to write them once the port 
+// is writable, or without one the next send or wait for input writes them. 
+// The owner itself passes owner to skip waking itself.
+static void drain_tx(JaguarConnection *conn, bool owner)
+{
+    uint64_t wakeup;
+
+    if (conn->transport->drain != NULL) {
+        conn->transport->drain(conn);
+    }
+    if (!owner && conn->io_running && tx_queued(conn)) {
+        wakeup = 1;
+        write(conn->wake_fd, &wakeup, sizeof(wakeup));
+    }
+}
+
+// Write what the transmit ring still holds, once the port is writable
+static void flush_tx(JaguarConnection *conn)
+{
+    if (conn->transport->flush == NULL || !tx_queued(conn)) {
+        return;
+    }
+    pthread_mutex_lock(&conn->tx_lock);
+    if (conn->transport->flush(conn) != JAGUAR_OK) {
+        count_stat(&conn->stats.write_errors, 1);
+    }
+    pthread_mutex_unlock(&conn->tx_lock);
+}
+
+// Send one message. Returns JAGUAR_BUSY if the transport could not take 
+// it, and JAGUAR_ERROR if the transport failed.
+int send_can_message(JaguarConnection *conn, CANMessage *message)
+{
+    uint8_t size;
+    int result;
+
+    size = encoded_size(message);
+    pthread_mutex_lock(&conn->tx_lock);
+    result = conn->transport->send(conn, message, 1);
+    if (result == JAGUAR_OK) {
+        occupy_line(conn, size);
+        tap_frame(conn, JAGUAR_TAP_TX, message);
+        trace_frame(conn, JAGUAR_TRACE_TX, message);
+        count_sent(conn, message, size);
+        drain_tx(conn, false);
+    }
+    pthread_mutex_unlock(&conn->tx_lock);
+    if (result != JAGUAR_OK) {
+        count_stat(&conn->stats.write_errors, 1);
+    }
+
+    return result;
+}
+
+// Send several messages back to back, setting queued when the transport 
+// took them
+static int send_frames(JaguarConnection *conn, CANMessage *messages, 
+        int count, bool *queued)
+{
+    size_t size;
+    uint8_t message_size;
+    int result;
+    int i;
+
+    pthread_mutex_lock(&conn->tx_lock);
+    result = conn->transport->send(conn, messages, count);
+    *queued = result == JAGUAR_OK;
+    if (result == JAGUAR_OK) {
+        size = 0;
+        for (i = 0; i < count; i++) {
+            message_size = encoded_size(&messages[i]);
+            size += message_size;
+            count_sent(conn, &messages[i], message_size);
+            tap_frame(conn, JAGUAR_TAP_TX, &messages[i]);
+            trace_frame(conn, JAGUAR_TRACE_TX, &messages[i]);
+        }
+        occupy_line(conn, size);
+        drain_tx(conn, false);
+    }
+    pthread_mutex_unlock(&conn->tx_lock);
+    if (result != JAGUAR_OK) {
+        count_stat(&conn->stats.write_errors, 1);
+    }
+
+    return result;
+}
+
+// Send several messages back to back in as few system calls as the 
+// transport allows, so they leave the host together
+int send_can_messages(JaguarConnection *conn, CANMessage *messages, int count)
+{
+    bool queued;
+
+    return send_frames(conn, messages, count, &queued);
+}
+
+// Read whatever the transport has without blocking. Returns the number of 
+// bytes read, 0 if there were none or -1 if the transport failed.
+static int fill_rx_buffer(JaguarConnection *conn)
+{
+    int filled;
+
+    filled = conn->transport->fill(conn);
+    if (filled > 0) {
+        count_stat(&conn->stats.bytes_received, (uint64_t) filled);
+    }
+    return filled;
+}
+
+// Close a heartbeat timer stopped while the connection had an owner. Only 
+// called by the thread handling the connection's io, which is the only one 
+// polling or reading the timer.
+static void reap_heartbeat(JaguarConnection *conn)
+{
+    if (!__atomic_load_n(&conn->heartbeat_stop, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->heartbeat_stop) {
+        close(conn->heartbeat_fd);
+        conn->heartbeat_fd = -1;
+        conn->heartbeat_stop = false;
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Sleep until the serial port is readable or the deadline passes, writing 
+// out the transmit ring whenever the port has room for it. Returns 
+// JAGUAR_PENDING if the connection was woken up by another thread.
+static int wait_readable(JaguarConnection *conn, uint64_t deadline_us)
+{
+    uint64_t now;
+    uint64_t remaining;
+    uint64_t wakeups;
+    struct pollfd pfd[3];
+    struct timespec timeout;
+    int result;
+
+    reap_heartbeat(conn);
+    now = jaguar_time_us();
+    if (now >= deadline_us) {
+        return JAGUAR_TIMEOUT;
+    }
+    remaining = deadline_us - now;
+    timeout.tv_sec = remaining / 1000000;
+    timeout.tv_nsec = (remaining % 1000000) * 1000;
+
+    pfd[0].fd = conn->serial_fd;
+    pfd[0].events = tx_queued(conn) ? POLLIN | POLLOUT : POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = conn->wake_fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    pfd[2].fd = __atomic_load_n(&conn->heartbeat_fd, __ATOMIC_ACQUIRE);
+    pfd[2].events = POLLIN;
+    pfd[2].revents = 0;
+
+    result = ppoll(pfd, pfd[2].fd < 0 ? 2 : 3, &timeout, NULL);
+    if (result < 0) {
+        return errno == EINTR ? JAGUAR_OK : JAGUAR_ERROR;
+    }
+    if (result == 0) {
+        return JAGUAR_TIMEOUT;
+    }
+    if (pfd[0].revents & POLLOUT) {
+        flush_tx(conn);
+    }
+    if (pfd[2].revents & POLLIN) {
+        // heartbeats go out while waiting, between received frames
+        service_jaguar_heartbeat(conn);
+    }
+    if (pfd[1].revents & POLLIN) {
+        read(conn->wake_fd, &wakeups, sizeof(wakeups));
+        return JAGUAR_PENDING;
+    }
+    if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+// Take the next message out of what the transport has read
+static int parse_rx_buffer(JaguarConnection *conn, CANMessage *message)
+{
+    int result;
+
+    result = conn->transport->parse(conn, message);
+    if (result == PARSE_FRAME) {
+        count_received(conn, message);
+        tap_frame(conn, JAGUAR_TAP_RX, message);
+        trace_frame(conn, JAGUAR_TRACE_RX, message);
+    } else if (result == PARSE_ERROR) {
+        count_stat(&conn->stats.decode_errors, 1);
+        trace_event(conn, JAGUAR_TRACE_DECODE_ERROR, 0, 0, 0);
+        trace_fault(conn, false);
+    }
+
+    return result;
+}
+
+int recieve_can_message(JaguarConnection *conn, CANMessage *message)
+{
+    return recieve_can_message_deadline(conn, message, 
+            jaguar_time_us() + conn->timeout_us);
+}
+
+int recieve_can_message_deadline(JaguarConnection *conn, CANMessage *message,
+        uint64_t deadline_us)
+{
+    int result;
+    int filled;
+    uint64_t spin_until;
+
+    spin_until = 0;
+    if (conn->serial_options.read_strategy == JAGUAR_READ_SPIN) {
+        spin_until = jaguar_time_us() + conn->serial_options.spin_us;
+        if (spin_until > deadline_us) {
+            spin_until = deadline_us;
+        }
+    }
+
+    // wait until a complete frame has been buffered
+    result = parse_rx_buffer(conn, message);
+    while (result == PARSE_NEED_MORE) {
+        filled = fill_rx_buffer(conn);
+        if (filled < 0) {
+            return JAGUAR_ERROR;
+        }
+        if (filled == 0 && spin_until > 0) {
+            // the owner stops spinning to send what was submitted meanwhile
+            if (__atomic_load_n(&conn->submissions, __ATOMIC_ACQUIRE) 
+                    != NULL) {
+                return JAGUAR_PENDING;
+            }
+            if (jaguar_time_us() < spin_until) {
+                continue;
+            }
+            spin_until = 0;
+        }
+        if (filled == 0) {
+            // nothing available, sleep until there is
+            filled = wait_readable(conn, deadline_us);
+            if (filled != JAGUAR_OK) {
+                return filled;
+            }
+            continue;
+        }
+        result = parse_rx_buffer(conn, message);
+    }
+
+    if (result == PARSE_ERROR) {
+        // do not hand a partially decoded message to the caller
+        memset(message, 0, sizeof(CANMessage));
+        return JAGUAR_DECODE_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+int recieve_can_messages(JaguarConnection *conn, CANMessage *messages, 
+        int max_messages, int *decode_errors)
+{
+    int count;
+    int errors;
+    int result;
+
+    count = 0;
+    errors = 0;
+    if (max_messages <= 0) {
+        return 0;
+    }
+
+    // only read from the port when no complete frame is already buffered
+    result = parse_rx_buffer(conn, &messages[count]);
+    if (result == PARSE_NEED_MORE && fill_rx_buffer(conn) > 0) {
+        result = parse_rx_buffer(conn, &messages[count]);
+    }
+
+    while (result != PARSE_NEED_MORE) {
+        if (result == PARSE_FRAME) {
+            count += 1;
+            if (count == max_messages) {
+                break;
+            }
+        } else {
+            errors += 1;
+        }
+        result = parse_rx_buffer(conn, &messages[count]);
+    }
+
+    if (decode_errors != NULL) {
+        *decode_errors = errors;
+    }
+
+    return count;
+}
+
+int init_sys_message(CANMessage *message, uint8_t api_index)
+{
+    message->manufacturer = MANUFACTURER_SYS;
+    message->device_type = DEVTYPE_SYS;
+    message->api_class = API_SYS;
+    message->api_index = api_index;
+    return 0;
+}
+
+int init_jaguar_message(CANMessage *message, uint8_t api_class, uint8_t api_index)
+{
+    message->manufacturer = MANUFACTURER_TI;
+    message->device_type = DEVTYPE_MOTORCTRL;
+    message->api_class = api_class;
+    message->api_index = api_index;
+    return 0;
+}
+
+bool valid_sys_reply(CANMessage *message, CANMessage *reply)
+{
+    return reply->manufacturer == MANUFACTURER_SYS
+            && reply->device_type == DEVTYPE_SYS
+            && reply->api_class == API_SYS
+            && reply->api_index == message->api_index
+            && reply->device == message->device;
+}
+
+bool valid_jaguar_reply(CANMessage *message, CANMessage *reply)
+{
+    return reply->manufacturer == MANUFACTURER_TI 
+            && reply->device_type == DEVTYPE_MOTORCTRL
+            && reply->api_class == message->api_class
+            && reply->api_index == message->api_index
+            && reply->device == message->device;
+}
+
+bool valid_ack(CANMessage *message, CANMessage *ack)
+{
+    // An acknowledgement only identifies the device, system messages are 
+    // never acknowledged
+    return ack->manufacturer == MANUFACTURER_TI 
+            && ack->device_type == DEVTYPE_MOTORCTRL
+            && ack->api_class == API_ACK
+            && ack->device == message->device
+            && message->manufacturer == MANUFACTURER_TI;
+}
+
+int init_jaguar_transaction(JaguarTransaction *tx, CANMessage *message, 
+        uint8_t expect)
+{
+    tx->request = *message;
+    tx->expect = expect;
+    tx->status = JAGUAR_PENDING;
+    tx->deadline_us = 0;
+    tx->sent_us = 0;
+    tx->next = NULL;
+    tx->queued = false;
+    tx->unit = 1;
+    tx->callback = NULL;
+    tx->context = NULL;
+    return 0;
+}
+
+static void remove_pending(JaguarConnection *conn, int index)
+{
+    int i;
+
+    conn->pending_count -= 1;
+    for (i = index; i < conn->pending_count; i++) {
+        conn->pending[i] = conn->pending[i + 1];
+    }
+}
+
+// Index of the latency histogram for a request
+static int stats_class(CANMessage *message)
+{
+    if (message->manufacturer == MANUFACTURER_SYS) {
+        return JAGUAR_STATS_SYS;
+    }
+    return message->api_class & 0x0F;
+}
+
+// Sleep while a futex word still holds value, until woken or until the 
+// deadline passes, 0 for no deadline
+static void futex_wait(int *word, int value, uint64_t deadline_us)
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = deadline_us / 1000000;
+    deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+    syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, 
+            value, deadline_us != 0 ? &deadline : NULL, NULL, 
+            FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(int *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, 
+            NULL, NULL, 0);
+}
+
+// A device decodes its periodic status messages with a new layout once it 
+// has acknowledged it, so the layout is remembered then. Called with the 
+// connection lock held.
+static void remember_pstat_layout(JaguarConnection *conn, CANMessage *request)
+{
+    uint8_t index;
+
+    if (request->manufacturer != MANUFACTURER_TI 
+            || request->api_class != API_PSTAT 
+            || request->api_index < PSTAT_CFG_S0 
+            || request->api_index >= PSTAT_CFG_S0 + PSTAT_MESSAGES) {
+        return;
+    }
+
+    index = request->api_index - PSTAT_CFG_S0;
+    memcpy(conn->pstat_layout[request->device & 0x3F][index], request->data, 
+            MAX_DATA_BYTES);
+}
+
+// Set the final status of a transaction and wake the callers sleeping on 
+// the connection. The transaction may be gone as soon as the status is 
+// stored, so it is not touched after that.
+static void finish_transaction(JaguarConnection *conn, JaguarTransaction *tx,
+        int status)
+{
+    JaguarDeviceStats *device_stats;
+    uint64_t latency;
+
+    // transactions withdrawn before they were sent are not counted
+    if (tx->sent_us != 0) {
+        device_stats = &conn->device_stats[tx->request.device & 0x3F];
+        latency = jaguar_time_us() - tx->sent_us;
+        if (status == JAGUAR_OK) {
+            record_latency(&conn->stats.latency[stats_class(&tx->request)], 
+                    latency);
+            record_latency(&device_stats->latency, latency);
+        } else if (status == JAGUAR_TIMEOUT) {
+            count_stat(&conn->stats.timeouts, 1);
+            count_stat(&device_stats->timeouts, 1);
+        }
+        if (__atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE) != NULL) {
+            trace_event(conn, status == JAGUAR_TIMEOUT 
+                    ? JAGUAR_TRACE_TIMEOUT : JAGUAR_TRACE_COMPLETE, 
+                    can_message_id(&tx->request), (uint32_t) latency, 
+                    status);
+            if (status == JAGUAR_TIMEOUT) {
+                trace_fault(conn, true);
+            }
+        }
+    }
+
+    if (status == JAGUAR_OK) {
+        remember_pstat_layout(conn, &tx->request);
+    }
+    if (tx->callback != NULL) {
+        // called once the connection lock is released, see run_callbacks
+        tx->next = conn->completed;
+        __atomic_store_n(&conn->completed, tx, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&tx->status, status, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&conn->completions, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&conn->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&conn->completions);
+    }
+}
+
+// Call the callbacks of completed transactions. Transactions complete with 
+// the connection lock held, so callbacks are deferred until it is released
+// and are free to submit new requests. Trace dumps owed to timeouts are 
+// taken here for the same reason.
+static void run_callbacks(JaguarConnection *conn)
+{
+    JaguarTransaction *list;
+    JaguarTransaction *tx;
+    JaguarTransaction *next;
+
+    flush_trace_fault(conn);
+    if (__atomic_load_n(&conn->completed, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    list = conn->completed;
+    conn->completed = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    // the list holds the latest first, call them in completion order
+    tx = NULL;
+    while (list != NULL) {
+        next = list->next;
+        list->next = tx;
+        tx = list;
+        list = next;
+    }
+    for (; tx != NULL; tx = next) {
+        next = tx->next;
+        tx->callback(conn, tx, tx->context);
+    }
+}
+
+static void complete_pending(JaguarConnection *conn, int index, int status)
+{
+    JaguarTransaction *tx;
+
+    tx = conn->pending[index];
+    remove_pending(conn, index);
+    finish_transaction(conn, tx, status);
+}
+
+// Match an incoming message against the transactions in flight. Replies 
+// are matched on device, api class and api index. Acknowledgements carry 
+// only the device, and a device answers its requests in order, so an ack 
+// belongs to the oldest request to that device still waiting for one.
+static bool match_pending(JaguarConnection *conn, CANMessage *message)
+{
+    int i;
+    JaguarTransaction *tx;
+    bool valid;
+
+    for (i = 0; i < conn->pending_count; i++) {
+        tx = conn->pending[i];
+        if (message->api_class == API_ACK) {
+            if (!(tx->expect & JAGUAR_EXPECT_ACK) 
+                    || !valid_ack(&tx->request, message)) {
+                continue;
+            }
+            if (tx->expect & JAGUAR_EXPECT_REPLY) {
+                // acknowledged without the reply, it was lost
+                count_stat(&conn->stats.lost_replies, 1);
+                count_stat(&conn->device_stats[tx->request.device & 0x3F]
+                        .lost_replies, 1);
+                complete_pending(conn, i, JAGUAR_ERROR);
+                return true;
+            }
+            tx->expect = 0;
+        } else {
+            if (!(tx->expect & JAGUAR_EXPECT_REPLY)) {
+                continue;
+            }
+            if (tx->request.manufacturer == MANUFACTURER_SYS) {
+                valid = valid_sys_reply(&tx->request, message);
+            } else {
+                valid = valid_jaguar_reply(&tx->request, message);
+            }
+            if (!valid) {
+                continue;
+            }
+            tx->reply = *message;
+            tx->expect &= ~JAGUAR_EXPECT_REPLY;
+        }
+
+        if (tx->expect == 0) {
+            complete_pending(conn, i, JAGUAR_OK);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Fail every transaction whose deadline has passed
+static void expire_pending(JaguarConnection *conn, uint64_t now)
+{
+    int i;
+
+    i = 0;
+    while (i < conn->pending_count) {
+        if (conn->pending[i]->deadline_us <= now) {
+            complete_pending(conn, i, JAGUAR_TIMEOUT);
+        } else {
+            i += 1;
+        }
+    }
+}
+
+// Register a transaction as in flight, before its request is sent so a 
+// fast reply cannot be missed
+static int add_pending(JaguarConnection *conn, JaguarTransaction *tx)
+{
+    if (tx->deadline_us == 0) {
+        tx->deadline_us = jaguar_time_us() + conn->timeout_us;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->pending_count == JAGUAR_MAX_PENDING) {
+        pthread_mutex_unlock(&conn->lock);
+        tx->status = JAGUAR_BUSY;
+        return JAGUAR_BUSY;
+    }
+    tx->status = JAGUAR_PENDING;
+    if (tx->sent_us == 0) {
+        tx->sent_us = jaguar_time_us();
+    }
+    conn->pending[conn->pending_count] = tx;
+    conn->pending_count += 1;
+    trace_event(conn, JAGUAR_TRACE_START, can_message_id(&tx->request), 
+            tx->expect, 0);
+    pthread_mutex_unlock(&conn->lock);
+
+    return JAGUAR_OK;
+}
+
+// Take back a transaction whose request could not be sent, giving it the 
+// send error as status. Returns JAGUAR_OK if it completed in the meantime, 
+// a frame the port was slow to take may still have been answered.
+static int withdraw_pending(JaguarConnection *conn, JaguarTransaction *tx, 
+        int status)
+{
+    int i;
+
+    pthread_mutex_lock(&conn->lock);
+    for (i = 0; i < conn->pending_count; i++) {
+        if (conn->pending[i] == tx) {
+            remove_pending(conn, i);
+            tx->status = status;
+            pthread_mutex_unlock(&conn->lock);
+            return status;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return JAGUAR_OK;
+}
+
+// Hand transactions to the thread that owns the connection's io, as one 
+// unit that is scheduled and sent together. The queue is a lock-free stack 
+// that the owner takes whole, so producers never block each other or the 
+// owner, and a unit is pushed in one go so it stays in one piece.
+static int queue_submissions(JaguarConnection *conn, JaguarTransaction *txs, 
+        int count)
+{
+    JaguarTransaction *head;
+    uint64_t wakeup;
+    uint64_t now;
+    int i;
+
+    // sent_us marks the submission until the owner hands the transaction to 
+    // the transport and stamps the actual send
+    now = jaguar_time_us();
+    for (i = 0; i < count; i++) {
+        txs[i].sent_us = now;
+        if (txs[i].deadline_us == 0) {
+            txs[i].deadline_us = now + conn->timeout_us;
+        }
+        txs[i].status = JAGUAR_PENDING;
+        txs[i].queued = true;
+        txs[i].unit = 0;
+        // newest first, like the rest of the stack
+        if (i > 0) {
+            txs[i].next = &txs[i - 1];
+        }
+        // traced before the push, the owner may complete it at once
+        trace_event(conn, JAGUAR_TRACE_START, 
+                can_message_id(&txs[i].request), txs[i].expect, 0);
+    }
+    txs[0].unit = (uint8_t) count;
+
+    head = __atomic_load_n(&conn->submissions, __ATOMIC_RELAXED);
+    do {
+        txs[0].next = head;
+    } while (!__atomic_compare_exchange_n(&conn->submissions, &head, 
+            &txs[count - 1], true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        // the owner may be asleep, later submissions ride along
+        wakeup = 1;
+        write(conn->wake_fd, &wakeup, sizeof(wakeup));
+    }
+
+    return JAGUAR_OK;
+}
+
+// Add the wire time that accrued since the last call to the budget of 
+// each class, up to a burst's worth
+static void refill_budgets(JaguarConnection *conn, uint64_t now)
+{
+    uint64_t elapsed;
+    int i;
+
+    elapsed = now - conn->budget_updated_us;
+    conn->budget_updated_us = now;
+    for (i = 0; i < JAGUAR_CLASSES; i++) {
+        conn->class_budget_us[i] += (int64_t) (elapsed 
+                * conn->class_share[i] / 100);
+        if (conn->class_budget_us[i] > JAGUAR_SCHED_BURST_US) {
+            conn->class_budget_us[i] = JAGUAR_SCHED_BURST_US;
+        }
+    }
+}
+
+// Line time of a transaction. The serial line carries the request one way 
+// and the answers the other way, whichever is longer paces transactions, 
+// plus the time the device takes to answer. An acknowledgement is a bare 
+// header, a reply repeats the identifier with up to 4 data bytes.
+static uint32_t transaction_wire_us(JaguarConnection *conn, 
+        JaguarTransaction *tx, uint8_t request_size)
+{
+    size_t size;
+
+    if (tx->expect == 0) {
+        // nothing comes back
+        return wire_time_us(conn, request_size);
+    }
+
+    size = 0;
+    if (tx->expect & JAGUAR_EXPECT_REPLY) {
+        size += HEADER_SIZE + 4;
+    }
+    if (tx->expect & JAGUAR_EXPECT_ACK) {
+        size += HEADER_SIZE;
+    }
+
+    return wire_time_us(conn, size > request_size ? size : request_size) 
+            + conn->turnaround_us;
+}
+
+// The class to send from next: the most urgent one with frames waiting and 
+// budget left, or if every waiting class has used up its budget the most 
+// urgent of them, as the line would otherwise be idle. Returns -1 if no 
+// frame is waiting.
+static int next_class(JaguarConnection *conn)
+{
+    int spare;
+    int i;
+
+    spare = -1;
+    for (i = 0; i < JAGUAR_CLASSES; i++) {
+        if (conn->class_head[i] == NULL) {
+            continue;
+        }
+        if (i <= JAGUAR_CLASS_HEARTBEAT || conn->class_budget_us[i] > 0) {
+            return i;
+        }
+        if (spare < 0) {
+            spare = i;
+        }
+    }
+
+    return spare;
+}
+
+// Finish a unit taken off its class queue without sending it
+static void finish_unit(JaguarConnection *conn, JaguarTransaction *tx, 
+        int status)
+{
+    JaguarTransaction *next;
+
+    for (; tx != NULL; tx = next) {
+        next = tx->next;
+        finish_transaction(conn, tx, status);
+    }
+}
+
+// Move the transactions submitted since the last call to the queues of 
+// their classes, then send from the queues while the line has room, all in 
+// one send. A unit is queued, scheduled and sent whole, in the class of its 
+// first transaction. Called by the thread that owns the connection's io. 
+// Once the connection has no owner anymore, everything still queued is 
+// sent.
+static void flush_submissions(JaguarConnection *conn)
+{
+    CANMessage batch[JAGUAR_MAX_PENDING + 1];
+    JaguarTransaction *unanswered[JAGUAR_MAX_PENDING + 1];
+    JaguarTransaction *awaited[JAGUAR_MAX_PENDING + 1];
+    JaguarTransaction *list;
+    JaguarTransaction *tx;
+    JaguarTransaction *last;
+    JaguarTransaction *next;
+    uint64_t line_free;
+    uint64_t blocked_us;
+    uint64_t now;
+    uint32_t wire_us;
+    uint32_t first_us;
+    uint8_t size;
+    int count;
+    int silent;
+    int awaiting;
+    int answered;
+    int units;
+    int traffic_class;
+    int result;
+    bool blocked;
+    int i;
+    int j;
+
+    list = __atomic_exchange_n(&conn->submissions, NULL, __ATOMIC_ACQUIRE);
+
+    // the stack holds the newest first, reverse it into submission order
+    tx = NULL;
+    while (list != NULL) {
+        next = list->next;
+        list->next = tx;
+        tx = list;
+        list = next;
+    }
+    for (; tx != NULL; tx = next) {
+        last = tx;
+        for (i = 1; i < tx->unit; i++) {
+            last = last->next;
+        }
+        next = last->next;
+        last->next = NULL;
+        traffic_class = get_jaguar_class(&tx->request);
+        if (conn->class_tail[traffic_class] == NULL) {
+            conn->class_head[traffic_class] = tx;
+        } else {
+            conn->class_tail[traffic_class]->next = tx;
+        }
+        conn->class_tail[traffic_class] = last;
+    }
+
+    now = jaguar_time_us();
+    refill_budgets(conn, now);
+    pthread_mutex_lock(&conn->tx_lock);
+    line_free = conn->line_free_us > now ? conn->line_free_us : now;
+    pthread_mutex_unlock(&conn->tx_lock);
+
+    // copy requests while holding the lock, a caller whose transaction is 
+    // in flight may expire it and return as soon as the lock is released
+    count = 0;
+    silent = 0;
+    awaiting = 0;
+    blocked = false;
+    blocked_us = 0;
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->io_running 
+            || line_free < now + JAGUAR_SCHED_LOOKAHEAD_US) {
+        traffic_class = next_class(conn);
+        if (traffic_class < 0) {
+            break;
+        }
+        tx = conn->class_head[traffic_class];
+        units = tx->unit > 1 ? tx->unit : 1;
+        if (count + units > JAGUAR_MAX_PENDING + 1) {
+            // the next send takes it
+            break;
+        }
+
+        last = tx;
+        wire_us = 0;
+        answered = 0;
+        for (i = 0; i < units; i++) {
+            if (i > 0) {
+                last = last->next;
+            }
+            wire_us += transaction_wire_us(conn, last, 
+                    encoded_size(&last->request));
+            if (last->expect != 0) {
+                answered += 1;
+            }
+            if (i == 0) {
+                first_us = wire_us;
+            }
+        }
+        if (units > 1 && conn->io_running 
+                && conn->pending_count + answered > JAGUAR_MAX_PENDING 
+                && tx->deadline_us > line_free + first_us) {
+            // wait for answers to make room rather than split the unit
+            blocked = true;
+            break;
+        }
+        conn->class_head[traffic_class] = last->next;
+        if (last->next == NULL) {
+            conn->class_tail[traffic_class] = NULL;
+        }
+        last->next = NULL;
+        for (last = tx; last != NULL; last = last->next) {
+            last->queued = false;
+        }
+
+        if (tx->deadline_us <= line_free + first_us) {
+            // it cannot be answered in time, do not spend the line on it. 
+            // The rest of a unit is answered in time or not like any 
+            // transaction that was sent.
+            finish_unit(conn, tx, JAGUAR_TIMEOUT);
+            continue;
+        }
+        if (conn->pending_count + answered > JAGUAR_MAX_PENDING) {
+            finish_unit(conn, tx, JAGUAR_BUSY);
+            continue;
+        }
+        for (; tx != NULL; tx = tx->next) {
+            if (tx->expect != 0) {
+                conn->pending[conn->pending_count] = tx;
+                conn->pending_count += 1;
+                awaited[awaiting] = tx;
+                awaiting += 1;
+            } else {
+                // completed once sent, not a round trip
+                tx->sent_us = 0;
+                unanswered[silent] = tx;
+                silent += 1;
+            }
+            batch[count] = tx->request;
+            count += 1;
+        }
+
+        line_free += wire_us;
+        conn->class_budget_us[traffic_class] -= wire_us;
+    }
+    // a blocked unit waits until answers or timeouts free the pending 
+    // table, the earliest deadline bounds the wait
+    if (blocked) {
+        blocked_us = tx->deadline_us;
+        for (i = 0; i < conn->pending_count; i++) {
+            if (conn->pending[i]->deadline_us < blocked_us) {
+                blocked_us = conn->pending[i]->deadline_us;
+            }
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    run_callbacks(conn);
+
+    // come back once the line has room for the frames still waiting
+    conn->schedule_us = 0;
+    for (i = 0; i < JAGUAR_CLASSES; i++) {
+        if (conn->class_head[i] != NULL) {
+            conn->schedule_us = blocked ? blocked_us 
+                    : line_free - JAGUAR_SCHED_LOOKAHEAD_US;
+            break;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&conn->tx_lock);
+    result = conn->transport->send(conn, batch, count);
+    if (result != JAGUAR_OK) {
+        count_stat(&conn->stats.write_errors, 1);
+    } else {
+        now = jaguar_time_us();
+        for (i = 0; i < count; i++) {
+            size = encoded_size(&batch[i]);
+            count_sent(conn, &batch[i], size);
+            tap_frame(conn, JAGUAR_TAP_TX, &batch[i]);
+            trace_frame(conn, JAGUAR_TRACE_TX, &batch[i]);
+        }
+        drain_tx(conn, true);
+        if (conn->line_free_us < line_free) {
+            conn->line_free_us = line_free;
+        }
+    }
+    pthread_mutex_unlock(&conn->tx_lock);
+
+    // only pointers are compared, a transaction of the batch that already 
+    // completed may be gone
+    pthread_mutex_lock(&conn->lock);
+    for (i = conn->pending_count - 1; i >= 0; i--) {
+        for (j = 0; j < awaiting; j++) {
+            if (conn->pending[i] == awaited[j]) {
+                break;
+            }
+        }
+        if (j == awaiting) {
+            continue;
+        }
+        tx = conn->pending[i];
+        if (result == JAGUAR_OK) {
+            // the round trip starts once the transport took the frame
+            tx->sent_us = now;
+        } else {
+            // none of the batch went out, fail it rather than let it time 
+            // out
+            remove_pending(conn, i);
+            finish_transaction(conn, tx, result);
+        }
+    }
+    for (i = 0; i < silent; i++) {
+        finish_transaction(conn, unanswered[i], result);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    run_callbacks(conn);
+}
+
+int set_jaguar_class_share(JaguarConnection *conn, int traffic_class, 
+        uint8_t percent)
+{
+    if (traffic_class < 0 || traffic_class >= JAGUAR_CLASSES 
+            || percent > 100) {
+        return JAGUAR_ERROR;
+    }
+
+    conn->class_share[traffic_class] = percent;
+    return JAGUAR_OK;
+}
+
+int submit_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx)
+{
+    int result;
+
+    if (conn->io_running) {
+        return queue_submissions(conn, tx, 1);
+    }
+
+    if (tx->expect == 0) {
+        // nothing to wait for, it completes once the transport took it
+        result = send_can_message(conn, &tx->request);
+        if (result != JAGUAR_OK) {
+            tx->status = result;
+            return result;
+        }
+        pthread_mutex_lock(&conn->lock);
+        finish_transaction(conn, tx, JAGUAR_OK);
+        pthread_mutex_unlock(&conn->lock);
+        run_callbacks(conn);
+        return JAGUAR_OK;
+    }
+
+    result = add_pending(conn, tx);
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    result = send_can_message(conn, &tx->request);
+    if (result != JAGUAR_OK) {
+        // nothing will answer what was not sent
+        return withdraw_pending(conn, tx, result);
+    }
+
+    return JAGUAR_OK;
+}
+
+static int dispatch_page(uint32_t id)
+{
+    uint8_t manufacturer;
+    uint8_t device_type;
+    uint8_t api_class;
+
+    manufacturer = (uint8_t) (id >> 16);
+    device_type = (uint8_t) ((id >> 24) & 0x1F);
+    api_class = (uint8_t) ((id >> 10) & 0x3F);
+
+    if (api_class >= DISPATCH_PAGES / 2) {
+        return -1;
+    }
+    if (manufacturer == MANUFACTURER_SYS && device_type == DEVTYPE_SYS) {
+        return api_class;
+    }
+    if (manufacturer == MANUFACTURER_TI && device_type == DEVTYPE_MOTORCTRL) {
+        return DISPATCH_PAGES / 2 + api_class;
+    }
+
+    return -1;
+}
+
+// A handler call in progress on this thread. A callback that removes a 
+// handler does not wait for the calls it is itself inside of.
+typedef struct DispatchFrame {
+    JaguarConnection *conn;
+    unsigned int epoch;
+    struct DispatchFrame *outer;
+} DispatchFrame;
+
+static __thread DispatchFrame *dispatch_frames;
+
+// Call the handler in a dispatch slot, if any. Instead of taking a lock 
+// for every frame, the caller is counted as a reader of the current 
+// dispatch epoch while it is inside the handler, see 
+// wait_dispatch_readers().
+static bool call_handler(JaguarConnection *conn, JaguarHandler **slot, 
+        CANMessage *message)
+{
+    DispatchFrame frame;
+    JaguarHandler *handler;
+
+    if (__atomic_load_n(slot, __ATOMIC_RELAXED) == NULL) {
+        return false;
+    }
+
+    frame.conn = conn;
+    frame.epoch = __atomic_load_n(&conn->dispatch_epoch, __ATOMIC_ACQUIRE) 
+            & 1;
+    __atomic_add_fetch(&conn->dispatch_readers[frame.epoch], 1, 
+            __ATOMIC_SEQ_CST);
+    handler = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+    if (handler != NULL) {
+        frame.outer = dispatch_frames;
+        dispatch_frames = &frame;
+        handler->callback(conn, message, handler->context);
+        dispatch_frames = frame.outer;
+    }
+    __atomic_sub_fetch(&conn->dispatch_readers[frame.epoch], 1, 
+            __ATOMIC_RELEASE);
+
+    return handler != NULL;
+}
+
+// Wait until no thread is inside a handler that was replaced before the 
+// call. New readers count against the next epoch, so only the calls that 
+// may have seen the old handler are waited for, and a steady stream of 
+// frames cannot hold the wait up.
+static void wait_dispatch_readers(JaguarConnection *conn)
+{
+    DispatchFrame *frame;
+    unsigned int epoch;
+    int own;
+
+    epoch = __atomic_fetch_add(&conn->dispatch_epoch, 1, __ATOMIC_SEQ_CST) 
+            & 1;
+    own = 0;
+    for (frame = dispatch_frames; frame != NULL; frame = frame->outer) {
+        if (frame->conn == conn && frame->epoch == epoch) {
+            own += 1;
+        }
+    }
+    while (__atomic_load_n(&conn->dispatch_readers[epoch], __ATOMIC_SEQ_CST) 
+            > own) {
+        sched_yield();
+    }
+}
+
+// Hand a message to the handler registered for its identifier
+static bool dispatch_message(JaguarConnection *conn, CANMessage *message)
+{
+    int page_index;
+    JaguarHandler **page;
+
+    page_index = dispatch_page(can_message_id(message));
+    if (page_index < 0) {
+        return false;
+    }
+    page = __atomic_load_n(&conn->dispatch[page_index], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        return false;
+    }
+
+    return call_handler(conn, &page[(message->api_index << 6 
+            | message->device) & (DISPATCH_PAGE_SIZE - 1)], message);
+}
+
+// Record a status value from a motor controller in the telemetry cache, 
+// must be called with the connection lock held
+static void store_status(JaguarTelemetry *telemetry, uint8_t status_index, 
+        uint8_t *data, uint64_t now)
+{
+    int16_t value16;
+    int32_t value32;
+
+    value16 = (int16_t) (data[0] | data[1] << 8);
+    value32 = (int32_t) ((uint32_t) data[0] | (uint32_t) data[1] << 8 
+            | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+
+    switch (status_index) {
+    case STATUS_OUTPUT_PERCENT:
+        telemetry->output_percent = value16;
+        break;
+    case STATUS_BUS_VOLTAGE:
+        telemetry->bus_voltage = (uint16_t) value16;
+        break;
+    case STATUS_CURRENT:
+        telemetry->current = value16;
+        break;
+    case STATUS_TEMPERATURE:
+        telemetry->temperature = (uint16_t) value16;
+        break;
+    case STATUS_POSITION:
+        telemetry->position = value32;
+        break;
+    case STATUS_SPEED:
+        telemetry->speed = value32;
+        break;
+    case STATUS_LIMIT:
+        telemetry->limit = data[0];
+        break;
+    case STATUS_FAULT:
+        telemetry->fault = data[0];
+        break;
+    case STATUS_POWER:
+        telemetry->power = (uint16_t) value16;
+        break;
+    case STATUS_MODE:
+        telemetry->mode = data[0];
+        break;
+    case STATUS_OUTPUT_VOLTS:
+        telemetry->output_volts = value16;
+        break;
+    default:
+        return;
+    }
+
+    telemetry->updated_us[status_index] = now;
+}
+
+// Status replies and periodic status messages update the telemetry cache 
+// whoever asked for them. Returns true for periodic status messages, which 
+// are consumed here.
+static bool update_telemetry(JaguarConnection *conn, CANMessage *message)
+{
+    uint8_t device;
+    uint8_t index;
+
+    if (message->manufacturer != MANUFACTURER_TI
+            || message->device_type != DEVTYPE_MOTORCTRL
+            || message->data_size == 0) {
+        return false;
+    }
+
+    device = message->device & 0x3F;
+    if (message->api_class == API_STATUS) {
+        store_status(&conn->telemetry[device], message->api_index, 
+                message->data, jaguar_time_us());
+        return false;
+    }
+
+    if (message->api_class == API_PSTAT 
+            && message->api_index >= PSTAT_DATA_S0
+            && message->api_index < PSTAT_DATA_S0 + PSTAT_MESSAGES) {
+        index = message->api_index - PSTAT_DATA_S0;
+        decode_periodic_status(conn->pstat_layout[device][index], message, 
+                &conn->telemetry[device], jaguar_time_us());
+        return true;
+    }
+
+    return false;
+}
+
+// Devices answer an enumeration with the enumeration message carrying 
+// their own device number, record them in the device table. Returns true 
+// for those answers, which are consumed here.
+static bool update_devices(JaguarConnection *conn, CANMessage *message)
+{
+    uint8_t device;
+
+    if (message->manufacturer != MANUFACTURER_SYS
+            || message->device_type != DEVTYPE_SYS
+            || message->api_class != API_SYS
+            || message->api_index != SYS_ENUMERATION) {
+        return false;
+    }
+
+    device = message->device & 0x3F;
+    if (device != 0) {
+        conn->devices[device].present = true;
+        conn->devices[device].seen_us = jaguar_time_us();
+    }
+
+    return true;
+}
+
+// Route a received message to its handler, the telemetry cache, the device 
+// table and the transaction waiting for it
+static void handle_message(JaguarConnection *conn, CANMessage *message)
+{
+    bool handled;
+
+    handled = dispatch_message(conn, message);
+    pthread_mutex_lock(&conn->lock);
+    handled |= update_telemetry(conn, message);
+    handled |= update_devices(conn, message);
+    handled |= match_pending(conn, message);
+    pthread_mutex_unlock(&conn->lock);
+    run_callbacks(conn);
+
+    if (!handled) {
+        // unsolicited message nobody is waiting for
+        if (message->api_class == API_ACK 
+                && message->manufacturer == MANUFACTURER_TI) {
+            count_stat(&conn->stats.invalid_acks, 1);
+        } else {
+            count_stat(&conn->stats.invalid_replies, 1);
+        }
+        call_handler(conn, &conn->default_handler, message);
+    }
+}
+
+// Expire transactions past their deadline, or fail all of them if the 
+// port failed, and wake up the threads waiting on the connection
+static void settle_pending(JaguarConnection *conn, int result)
+{
+    pthread_mutex_lock(&conn->lock);
+    if (result == JAGUAR_ERROR) {
+        // the port failed, nothing in flight can complete
+        while (conn->pending_count > 0) {
+            complete_pending(conn, 0, JAGUAR_ERROR);
+        }
+    } else {
+        expire_pending(conn, jaguar_time_us());
+    }
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    run_callbacks(conn);
+}
+
+int process_jaguar_messages(JaguarConnection *conn, uint64_t deadline_us)
+{
+    CANMessage message;
+    int result;
+
+    result = recieve_can_message_deadline(conn, &message, deadline_us);
+    if (result == JAGUAR_OK) {
+        handle_message(conn, &message);
+    }
+    settle_pending(conn, result);
+
+    return result;
+}
+
+// Handle every message that can be read without blocking, for event loops 
+// that watch serial_fd themselves. Returns the number of messages handled, 
+// or -1 if the port failed.
+int poll_jaguar_messages(JaguarConnection *conn)
+{
+    CANMessage message;
+    int count;
+    int filled;
+    int result;
+
+    service_jaguar_heartbeat(conn);
+
+    // read once per call so one busy bus cannot starve the others
+    count = 0;
+    filled = 0;
+    for (;;) {
+        result = parse_rx_buffer(conn, &message);
+        if (result == PARSE_FRAME) {
+            handle_message(conn, &message);
+            count += 1;
+        } else if (result == PARSE_NEED_MORE) {
+            if (filled != 0) {
+                break;
+            }
+            filled = fill_rx_buffer(conn);
+            if (filled <= 0) {
+                break;
+            }
+        }
+    }
+
+    settle_pending(conn, filled < 0 ? JAGUAR_ERROR : JAGUAR_OK);
+
+    return filled < 0 ? -1 : count;
+}
+
+// Sleep until the io owner completes a transaction. Callers are woken on 
+// every completion on the connection and go back to sleep if theirs is 
+// still pending, and a caller whose deadline passes expires the 
+// transaction itself.
+static int wait_completion(JaguarConnection *conn, JaguarTransaction *tx)
+{
+    uint64_t deadline;
+    uint64_t now;
+    int completions;
+    int status;
+
+    deadline = tx->deadline_us;
+    for (;;) {
+        status = __atomic_load_n(&tx->status, __ATOMIC_ACQUIRE);
+        if (status != JAGUAR_PENDING) {
+            return status;
+        }
+
+        now = jaguar_time_us();
+        if (deadline != 0 && now >= deadline) {
+            pthread_mutex_lock(&conn->lock);
+            if (!tx->queued) {
+                expire_pending(conn, now);
+            }
+            pthread_mutex_unlock(&conn->lock);
+            run_callbacks(conn);
+            // a transaction still queued belongs to the owner, which times 
+            // it out when it takes it from the queue
+            deadline = 0;
+            continue;
+        }
+
+        // a completion between the status check and the sleep changes 
+        // the word, so the sleep returns at once
+        __atomic_add_fetch(&conn->sleepers, 1, __ATOMIC_SEQ_CST);
+        completions = __atomic_load_n(&conn->completions, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tx->status, __ATOMIC_SEQ_CST) 
+                == JAGUAR_PENDING) {
+            futex_wait(&conn->completions, completions, deadline);
+        }
+        __atomic_sub_fetch(&conn->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Check on a transaction without blocking. Returns JAGUAR_PENDING while it 
+// is in flight, first handling whatever input is available when no io 
+// thread or event loop does.
+int poll_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx)
+{
+    if (!conn->io_running 
+            && __atomic_load_n(&tx->status, __ATOMIC_ACQUIRE) 
+                    == JAGUAR_PENDING) {
+        poll_jaguar_messages(conn);
+    }
+
+    return __atomic_load_n(&tx->status, __ATOMIC_ACQUIRE);
+}
+
+int wait_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx)
+{
+    if (!conn->io_running) {
+        while (tx->status == JAGUAR_PENDING) {
+            process_jaguar_messages(conn, tx->deadline_us);
+        }
+        return tx->status;
+    }
+
+    return wait_completion(conn, tx);
+}
+
+int wait_jaguar_transactions(JaguarConnection *conn, JaguarTransaction *txs,
+        int count)
+{
+    int i;
+    int result;
+    uint64_t deadline;
+
+    if (conn->io_running) {
+        for (i = 0; i < count; i++) {
+            wait_completion(conn, &txs[i]);
+        }
+    }
+
+    for (;;) {
+        // sleep no longer than the earliest unfinished deadline
+        deadline = 0;
+        for (i = 0; i < count; i++) {
+            if (txs[i].status == JAGUAR_PENDING && (deadline == 0 
+                    || txs[i].deadline_us < deadline)) {
+                deadline = txs[i].deadline_us;
+            }
+        }
+        if (deadline == 0) {
+            break;
+        }
+        process_jaguar_messages(conn, deadline);
+    }
+
+    result = JAGUAR_OK;
+    for (i = 0; i < count; i++) {
+        if (txs[i].status != JAGUAR_OK) {
+            result = txs[i].status;
+        }
+    }
+
+    return result;
+}
+
+// Handlers are read without a lock. Replacing or removing one returns once 
+// no other thread is inside it anymore, so it may be freed then.
+int register_jaguar_handler(JaguarConnection *conn, uint32_t id, 
+        JaguarHandler *handler)
+{
+    int page_index;
+    JaguarHandler **page;
+    JaguarHandler *old;
+
+    page_index = dispatch_page(id);
+    if (page_index < 0) {
+        return JAGUAR_INVALID_ID;
+    }
+
+    pthread_mutex_lock(&conn->dispatch_lock);
+    page = conn->dispatch[page_index];
+    if (page == NULL) {
+        if (handler == NULL) {
+            pthread_mutex_unlock(&conn->dispatch_lock);
+            return JAGUAR_OK;
+        }
+        page = calloc(DISPATCH_PAGE_SIZE, sizeof(JaguarHandler *));
+        if (page == NULL) {
+            pthread_mutex_unlock(&conn->dispatch_lock);
+            return JAGUAR_ERROR;
+        }
+        __atomic_store_n(&conn->dispatch[page_index], page, __ATOMIC_RELEASE);
+    }
+    old = __atomic_exchange_n(&page[id & (DISPATCH_PAGE_SIZE - 1)], handler, 
+            __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&conn->dispatch_lock);
+
+    if (old != NULL && old != handler) {
+        wait_dispatch_readers(conn);
+    }
+
+    return JAGUAR_OK;
+}
+
+int set_default_jaguar_handler(JaguarConnection *conn, JaguarHandler *handler)
+{
+    JaguarHandler *old;
+
+    old = __atomic_exchange_n(&conn->default_handler, handler, 
+            __ATOMIC_SEQ_CST);
+    if (old != NULL && old != handler) {
+        wait_dispatch_readers(conn);
+    }
+
+    return JAGUAR_OK;
+}
+
+// Set the tap every sent and received frame is passed to, NULL to remove 
+// it. Returns once no thread is inside the previous tap anymore.
+int set_jaguar_tap(JaguarConnection *conn, JaguarTap tap, void *context)
+{
+    __atomic_store_n(&conn->tap, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&conn->tap_users, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    conn->tap_context = context;
+    __atomic_store_n(&conn->tap, tap, __ATOMIC_SEQ_CST);
+
+    return JAGUAR_OK;
+}
+
+// Route a message as if the transport had received it, to handlers, the 
+// telemetry cache, the device table and waiting transactions. Used to 
+// replay captured traffic.
+int inject_jaguar_message(JaguarConnection *conn, CANMessage *message)
+{
+    count_received(conn, message);
+    handle_message(conn, message);
+
+    return JAGUAR_OK;
+}
+
+// Start recording events to the connection's trace ring, allocating it 
+// the first time. With a dump_path the dump file is created and mapped 
+// now, so dump_jaguar_trace() never allocates or does file io, and with 
+// dump_on_fault the ring is dumped whenever a frame fails to decode, or a 
+// transaction times out once the connection lock is released.
+int start_jaguar_trace(JaguarConnection *conn, const char *dump_path, 
+        bool dump_on_fault)
+{
+    JaguarTrace *trace;
+    void *dump;
+    size_t dump_size;
+    int fd;
+
+    trace = conn->trace;
+    if (trace == NULL) {
+        trace = calloc(1, sizeof(JaguarTrace));
+        if (trace == NULL) {
+            return JAGUAR_ERROR;
+        }
+    }
+    __atomic_store_n(&trace->enabled, false, __ATOMIC_RELAXED);
+
+    if (dump_path != NULL) {
+        dump_size = sizeof(JaguarTraceHeader) 
+                + JAGUAR_TRACE_RECORDS * sizeof(JaguarTraceRecord);
+        fd = open(dump_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            if (conn->trace == NULL) {
+                free(trace);
+            }
+            return JAGUAR_ERROR;
+        }
+        dump = MAP_FAILED;
+        if (ftruncate(fd, dump_size) == 0) {
+            dump = mmap(NULL, dump_size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                    fd, 0);
+        }
+        close(fd);
+        if (dump == MAP_FAILED) {
+            if (conn->trace == NULL) {
+                free(trace);
+            }
+            return JAGUAR_ERROR;
+        }
+
+        // wait out a dump still writing to the old file
+        while (__atomic_exchange_n(&trace->dumping, 1, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        if (trace->dump != NULL) {
+            munmap(trace->dump, trace->dump_size);
+        }
+        trace->dump = dump;
+        trace->dump_size = dump_size;
+        __atomic_store_n(&trace->dumping, 0, __ATOMIC_RELEASE);
+    }
+
+    trace->dump_on_fault = dump_on_fault;
+    trace->start_clock = trace_clock();
+    trace->start_ns = monotonic_ns();
+    __atomic_store_n(&conn->trace, trace, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace->enabled, true, __ATOMIC_RELEASE);
+
+    return JAGUAR_OK;
+}
+
+// Stop recording. The ring keeps what it has and can still be dumped, it 
+// is freed when the connection is closed.
+int stop_jaguar_trace(JaguarConnection *conn)
+{
+    JaguarTrace *trace;
+
+    trace = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL) {
+        return JAGUAR_ERROR;
+    }
+    __atomic_store_n(&trace->enabled, false, __ATOMIC_RELEASE);
+
+    return JAGUAR_OK;
+}
+
+// Copy the records in the ring to the mapped dump file, oldest first. 
+// Only copies memory, so it may be called from a signal handler or while 
+// events are still being recorded. Returns JAGUAR_BUSY if another dump is 
+// in progress.
+int dump_jaguar_trace(JaguarConnection *conn)
+{
+    JaguarTrace *trace;
+    JaguarTraceHeader *header;
+    JaguarTraceRecord *records;
+    JaguarTraceRecord *record;
+    uint64_t first;
+    uint64_t head;
+    uint64_t index;
+    uint64_t seq;
+    uint32_t count;
+
+    trace = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL || trace->dump == NULL) {
+        return JAGUAR_ERROR;
+    }
+    if (__atomic_exchange_n(&trace->dumping, 1, __ATOMIC_ACQUIRE)) {
+        return JAGUAR_BUSY;
+    }
+
+    header = trace->dump;
+    records = (JaguarTraceRecord *) (header + 1);
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    first = head > JAGUAR_TRACE_RECORDS ? head - JAGUAR_TRACE_RECORDS : 0;
+    count = 0;
+    for (index = first; index < head; index++) {
+        record = &trace->records[index & (JAGUAR_TRACE_RECORDS - 1)];
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq != index + 1) {
+            // still being written, or already overwritten
+            continue;
+        }
+        records[count] = *record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq) {
+            count += 1;
+        }
+    }
+
+    memcpy(header->magic, "JTRC", 4);
+    header->version = 2;
+#if defined(__x86_64__) || defined(__i386__)
+    header->clock = JAGUAR_TRACE_CLOCK_TSC;
+#else
+    header->clock = JAGUAR_TRACE_CLOCK_MONOTONIC;
+#endif
+    header->record_size = sizeof(JaguarTraceRecord);
+    header->count = count;
+    header->dumps += 1;
+    header->start_clock = trace->start_clock;
+    header->start_ns = trace->start_ns;
+    header->dump_clock = trace_clock();
+    header->dump_ns = monotonic_ns();
+    __atomic_store_n(&trace->dumping, 0, __ATOMIC_RELEASE);
+
+    return JAGUAR_OK;
+}
+
+typedef struct JaguarWaiter {
+    CANMessage *message;
+    bool done;
+} JaguarWaiter;
+
+static void deliver_waiter(JaguarConnection *conn, CANMessage *message, 
+        void *context)
+{
+    JaguarWaiter *waiter;
+
+    waiter = context;
+    if (waiter->done) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    *waiter->message = *message;
+    waiter->done = true;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+int wait_jaguar_message(JaguarConnection *conn, uint32_t id, 
+        CANMessage *message, uint64_t deadline_us)
+{
+    JaguarWaiter waiter;
+    JaguarHandler handler;
+    int result;
+    int page_index;
+    struct timespec deadline;
+
+    page_index = dispatch_page(id);
+    if (page_index < 0) {
+        return JAGUAR_INVALID_ID;
+    }
+
+    waiter.message = message;
+    waiter.done = false;
+    handler.callback = deliver_waiter;
+    handler.context = &waiter;
+
+    pthread_mutex_lock(&conn->dispatch_lock);
+    if (conn->dispatch[page_index] != NULL 
+            && conn->dispatch[page_index][id & (DISPATCH_PAGE_SIZE - 1)]) {
+        // another handler owns this identifier
+        pthread_mutex_unlock(&conn->dispatch_lock);
+        return JAGUAR_BUSY;
+    }
+    result = register_jaguar_handler(conn, id, &handler);
+    pthread_mutex_unlock(&conn->dispatch_lock);
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    result = JAGUAR_OK;
+    if (conn->io_running) {
+        deadline.tv_sec = deadline_us / 1000000;
+        deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+        pthread_mutex_lock(&conn->lock);
+        while (!waiter.done && result == JAGUAR_OK) {
+            if (pthread_cond_timedwait(&conn->cond, &conn->lock, &deadline) 
+                    == ETIMEDOUT) {
+                result = JAGUAR_TIMEOUT;
+            }
+        }
+        pthread_mutex_unlock(&conn->lock);
+    } else {
+        while (!waiter.done && result != JAGUAR_TIMEOUT 
+                && result != JAGUAR_ERROR) {
+            result = process_jaguar_messages(conn, deadline_us);
+        }
+    }
+
+    // removing the handler waits for a callback in progress to return
+    register_jaguar_handler(conn, id, NULL);
+
+    return waiter.done ? JAGUAR_OK : result;
+}
+
+// Earliest deadline of the transactions in flight on a connection or of 
+// its held back frames, or deadline_us if none is earlier
+static uint64_t next_deadline(JaguarConnection *conn, uint64_t deadline_us)
+{
+    int i;
+
+    pthread_mutex_lock(&conn->lock);
+    for (i = 0; i < conn->pending_count; i++) {
+        if (conn->pending[i]->deadline_us < deadline_us) {
+            deadline_us = conn->pending[i]->deadline_us;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    if (conn->schedule_us != 0 && conn->schedule_us < deadline_us) {
+        deadline_us = conn->schedule_us;
+    }
+
+    return deadline_us;
+}
+
+static void *jaguar_io_thread(void *arg)
+{
+    JaguarConnection *conn;
+    uint64_t deadline;
+
+    conn = arg;
+    while (!conn->io_stop) {
+        flush_submissions(conn);
+
+        // wake up in time to expire the earliest transaction, or to send 
+        // the frames the scheduler held back
+        deadline = next_deadline(conn, jaguar_time_us() + JAGUAR_IO_TICK_US);
+
+        if (process_jaguar_messages(conn, deadline) == JAGUAR_ERROR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int start_jaguar_io_thread(JaguarConnection *conn)
+{
+    if (conn->io_running) {
+        return JAGUAR_BUSY;
+    }
+
+    conn->io_stop = false;
+    conn->io_running = true;
+    if (pthread_create(&conn->io_thread, NULL, jaguar_io_thread, conn) != 0) {
+        conn->io_running = false;
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+int stop_jaguar_io_thread(JaguarConnection *conn)
+{
+    uint64_t wakeup;
+
+    if (!conn->io_running) {
+        return JAGUAR_OK;
+    }
+    if (conn->loop != NULL) {
+        // driven by an event loop, not by its own thread
+        return JAGUAR_BUSY;
+    }
+
+    conn->io_stop = true;
+    wakeup = 1;
+    write(conn->wake_fd, &wakeup, sizeof(wakeup));
+    pthread_join(conn->io_thread, NULL);
+    conn->io_running = false;
+
+    // send what was queued meanwhile, its callers still wait for it
+    flush_submissions(conn);
+
+    return JAGUAR_OK;
+}
+
+int open_jaguar_loop(JaguarLoop *loop, int cpu)
+{
+    struct epoll_event event;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        return JAGUAR_ERROR;
+    }
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        close(loop->epoll_fd);
+        return JAGUAR_ERROR;
+    }
+
+    // events with no connection come from the loop's own wake_fd
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event);
+
+    loop->cpu = cpu;
+    loop->connection_count = 0;
+    loop->active = NULL;
+    loop->detached = NULL;
+    loop->running = false;
+    loop->stop = false;
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_cond_init(&loop->idle, NULL);
+
+    return JAGUAR_OK;
+}
+
+int close_jaguar_loop(JaguarLoop *loop)
+{
+    stop_jaguar_loop(loop);
+    while (loop->connection_count > 0) {
+        remove_jaguar_loop_connection(loop, loop->connections[0]);
+    }
+
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    pthread_mutex_destroy(&loop->lock);
+    pthread_cond_destroy(&loop->idle);
+
+    return JAGUAR_OK;
+}
+
+// Watch a connection's serial port, wake_fd and heartbeat timer. All 
+// three report the connection itself.
+static void watch_fd(JaguarLoop *loop, JaguarConnection *conn, int fd)
+{
+    struct epoll_event event;
+
+    if (fd < 0) {
+        return;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Also wait for the serial port to become writable while the transmit 
+// ring holds bytes it could not take
+static void watch_tx(JaguarLoop *loop, JaguarConnection *conn)
+{
+    struct epoll_event event;
+    bool queued;
+
+    queued = tx_queued(conn);
+    if (queued == conn->tx_watched) {
+        return;
+    }
+    event.events = queued ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = conn;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->serial_fd, &event);
+    conn->tx_watched = queued;
+}
+
+static void unwatch_fd(JaguarLoop *loop, int fd)
+{
+    if (fd >= 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+int add_jaguar_loop_connection(JaguarLoop *loop, JaguarConnection *conn)
+{
+    pthread_mutex_lock(&loop->lock);
+    if (conn->io_running 
+            || loop->connection_count == JAGUAR_LOOP_MAX_CONNECTIONS) {
+        pthread_mutex_unlock(&loop->lock);
+        return JAGUAR_BUSY;
+    }
+
+    loop->connections[loop->connection_count] = conn;
+    loop->connection_count += 1;
+    conn->loop = loop;
+
+    // waiting calls now sleep until the loop completes their transaction
+    conn->io_running = true;
+
+    conn->tx_watched = false;
+    watch_fd(loop, conn, conn->serial_fd);
+    watch_fd(loop, conn, conn->wake_fd);
+    watch_fd(loop, conn, conn->heartbeat_fd);
+    pthread_mutex_unlock(&loop->lock);
+
+    return JAGUAR_OK;
+}
+
+int remove_jaguar_loop_connection(JaguarLoop *loop, JaguarConnection *conn)
+{
+    int i;
+
+    pthread_mutex_lock(&loop->lock);
+    for (i = 0; i < loop->connection_count; i++) {
+        if (loop->connections[i] == conn) {
+            break;
+        }
+    }
+    if (i == loop->connection_count) {
+        pthread_mutex_unlock(&loop->lock);
+        return JAGUAR_ERROR;
+    }
+
+    loop->connection_count -= 1;
+    loop->connections[i] = loop->connections[loop->connection_count];
+
+    unwatch_fd(loop, conn->serial_fd);
+    unwatch_fd(loop, conn->wake_fd);
+    unwatch_fd(loop, conn->heartbeat_fd);
+    if (loop->active == conn) {
+        if (pthread_equal(pthread_self(), loop->thread)) {
+            // called back while the loop services the connection, the 
+            // loop lets go of it once the callback has returned
+            loop->detached = conn;
+            pthread_mutex_unlock(&loop->lock);
+            return JAGUAR_OK;
+        }
+        while (loop->active == conn) {
+            pthread_cond_wait(&loop->idle, &loop->lock);
+        }
+    }
+    conn->loop = NULL;
+    conn->io_running = false;
+    pthread_mutex_unlock(&loop->lock);
+
+    flush_submissions(conn);
+
+    return JAGUAR_OK;
+}
+
+// Mark a connection as serviced by the loop thread and release the loop 
+// lock, so that callbacks and handlers run without it and may add or 
+// remove connections. Returns false, still holding the lock, if the 
+// connection was removed since the event was reported.
+static bool enter_connection(JaguarLoop *loop, JaguarConnection *conn)
+{
+    int i;
+
+    for (i = 0; i < loop->connection_count; i++) {
+        if (loop->connections[i] == conn) {
+            break;
+        }
+    }
+    if (i == loop->connection_count) {
+        return false;
+    }
+
+    loop->active = conn;
+    pthread_mutex_unlock(&loop->lock);
+
+    return true;
+}
+
+// Take the loop lock back once done with a connection, and let go of it 
+// if one of its callbacks removed it meanwhile
+static void leave_connection(JaguarLoop *loop, JaguarConnection *conn)
+{
+    pthread_mutex_lock(&loop->lock);
+    loop->active = NULL;
+    pthread_cond_broadcast(&loop->idle);
+    if (loop->detached != conn) {
+        return;
+    }
+
+    loop->detached = NULL;
+    conn->loop = NULL;
+    conn->io_running = false;
+    pthread_mutex_unlock(&loop->lock);
+    flush_submissions(conn);
+    pthread_mutex_lock(&loop->lock);
+}
+
+// Handle one readiness event for a connection, between enter_connection() 
+// and leave_connection()
+static void handle_loop_event(JaguarLoop *loop, JaguarConnection *conn)
+{
+    uint64_t wakeups;
+
+    if (read(conn->wake_fd, &wakeups, sizeof(wakeups)) == sizeof(wakeups)) {
+        // the heartbeat timer may have been started, a closed timer 
+        // leaves the epoll set on its own
+        watch_fd(loop, conn, conn->heartbeat_fd);
+    }
+    flush_tx(conn);
+    flush_submissions(conn);
+
+    if (poll_jaguar_messages(conn) < 0) {
+        // stop watching a failed port instead of spinning on it
+        unwatch_fd(loop, conn->serial_fd);
+        return;
+    }
+    if (conn->schedule_us != 0) {
+        // answers may have made room for held back frames
+        flush_submissions(conn);
+    }
+    watch_tx(loop, conn);
+}
+
+static void *jaguar_loop_thread(void *arg)
+{
+    JaguarLoop *loop;
+    JaguarConnection *conn;
+    struct epoll_event events[JAGUAR_LOOP_MAX_CONNECTIONS * 3 + 1];
+    cpu_set_t cpus;
+    uint64_t now;
+    uint64_t deadline;
+    uint64_t wakeups;
+    int timeout_ms;
+    int count;
+    int i;
+
+    loop = arg;
+    if (loop->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    while (!loop->stop) {
+        // wake up in time to expire the earliest transaction of any 
+        // connection
+        now = jaguar_time_us();
+        deadline = now + JAGUAR_IO_TICK_US;
+        pthread_mutex_lock(&loop->lock);
+        for (i = 0; i < loop->connection_count; i++) {
+            deadline = next_deadline(loop->connections[i], deadline);
+        }
+        pthread_mutex_unlock(&loop->lock);
+        timeout_ms = deadline > now ? (int) ((deadline - now + 999) / 1000) 
+                : 0;
+
+        count = epoll_wait(loop->epoll_fd, events, 
+                sizeof(events) / sizeof(events[0]), timeout_ms);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+
+        pthread_mutex_lock(&loop->lock);
+        for (i = 0; i < count; i++) {
+            conn = events[i].data.ptr;
+            if (conn == NULL) {
+                read(loop->wake_fd, &wakeups, sizeof(wakeups));
+                continue;
+            }
+            if (enter_connection(loop, conn)) {
+                handle_loop_event(loop, conn);
+                leave_connection(loop, conn);
+            }
+        }
+        // connections removed while the lock was released may be skipped 
+        // until the next pass, which only delays their deadlines a tick
+        now = jaguar_time_us();
+        for (i = 0; i < loop->connection_count; i++) {
+            conn = loop->connections[i];
+            if (!enter_connection(loop, conn)) {
+                continue;
+            }
+            if (conn->schedule_us != 0 && conn->schedule_us <= now) {
+                // the line has room for frames the scheduler held back
+                flush_submissions(conn);
+            }
+            settle_pending(conn, JAGUAR_OK);
+            leave_connection(loop, conn);
+        }
+        pthread_mutex_unlock(&loop->lock);
+    }
+
+    return NULL;
+}
+
+int start_jaguar_loop(JaguarLoop *loop)
+{
+    if (loop->running) {
+        return JAGUAR_BUSY;
+    }
+
+    loop->stop = false;
+    loop->running = true;
+    if (pthread_create(&loop->thread, NULL, jaguar_loop_thread, loop) != 0) {
+        loop->running = false;
+        return JAGUAR_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+int stop_jaguar_loop(JaguarLoop *loop)
+{
+    uint64_t wakeup;
+
+    if (!loop->running) {
+        return JAGUAR_OK;
+    }
+
+    loop->stop = true;
+    wakeup = 1;
+    write(loop->wake_fd, &wakeup, sizeof(wakeup));
+    pthread_join(loop->thread, NULL);
+    loop->running = false;
+
+    return JAGUAR_OK;
+}
+
+// Start a request, completion is reported through the transaction
+static int submit_request(JaguarConnection *conn, JaguarTransaction *tx, 
+        CANMessage *message, uint8_t expect, JaguarCompletion callback, 
+        void *context)
+{
+    init_jaguar_transaction(tx, message, expect);
+    tx->callback = callback;
+    tx->context = context;
+
+    return submit_jaguar_transaction(conn, tx);
+}
+
+// Wait for a transaction that was submitted with the given result
+static int await_transaction(JaguarConnection *conn, JaguarTransaction *tx, 
+        int submitted)
+{
+    if (submitted != JAGUAR_OK) {
+        return submitted;
+    }
+
+    return wait_jaguar_transaction(conn, tx);
+}
+
+// Values in replies are little endian and start at the first data byte
+static int check_reply(JaguarTransaction *tx, uint8_t size)
+{
+    int status;
+
+    status = __atomic_load_n(&tx->status, __ATOMIC_ACQUIRE);
+    if (status != JAGUAR_OK) {
+        return status;
+    }
+    if (tx->reply.data_size < size) {
+        return JAGUAR_DECODE_ERROR;
+    }
+
+    return JAGUAR_OK;
+}
+
+int get_reply_uint8(JaguarTransaction *tx, uint8_t *value)
+{
+    int result;
+
+    result = check_reply(tx, 1);
+    if (result == JAGUAR_OK) {
+        *value = tx->reply.data[0];
+    }
+
+    return result;
+}
+
+int get_reply_int16(JaguarTransaction *tx, int16_t *value)
+{
+    uint16_t raw;
+    int result;
+
+    result = get_reply_uint16(tx, &raw);
+    if (result == JAGUAR_OK) {
+        *value = (int16_t) raw;
+    }
+
+    return result;
+}
+
+int get_reply_uint16(JaguarTransaction *tx, uint16_t *value)
+{
+    int result;
+
+    result = check_reply(tx, 2);
+    if (result == JAGUAR_OK) {
+        *value = (uint16_t) (tx->reply.data[0] | tx->reply.data[1] << 8);
+    }
+
+    return result;
+}
+
+int get_reply_int32(JaguarTransaction *tx, int32_t *value)
+{
+    uint32_t raw;
+    int result;
+
+    result = get_reply_uint32(tx, &raw);
+    if (result == JAGUAR_OK) {
+        *value = (int32_t) raw;
+    }
+
+    return result;
+}
+
+int get_reply_uint32(JaguarTransaction *tx, uint32_t *value)
+{
+    int result;
+
+    result = check_reply(tx, 4);
+    if (result == JAGUAR_OK) {
+        *value = (uint32_t) tx->reply.data[0] 
+                | (uint32_t) tx->reply.data[1] << 8 
+                | (uint32_t) tx->reply.data[2] << 16 
+                | (uint32_t) tx->reply.data[3] << 24;
+    }
+
+    return result;
+}
+
+// System messages are never answered, the _async variants complete once 
+// the frame is handed to the transport
+int sys_heartbeat_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_HEARTBEAT);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_heartbeat(JaguarConnection *conn, uint8_t device)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_HEARTBEAT);
+    message.device = device;
+    message.data_size = 0;
+    return send_can_message(conn, &message);
+}
+
+int sys_sync_update_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t mask, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_SYNC_UPDATE);
+    message.device = 0;
+    message.data_size = 1;
+    message.data[0] = mask;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_sync_update(JaguarConnection *conn, uint8_t mask)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_SYNC_UPDATE);
+    message.device = 0;
+    message.data_size = 1;
+    message.data[0] = mask;
+    return send_can_message(conn, &message);
+}
+
+// Send heartbeats from a timer instead of relying on the caller. The timer 
+// is serviced whenever the connection waits for input, by the io thread or 
+// a blocking call, so start the io thread to keep heartbeats going while 
+// the application is busy elsewhere.
+int start_jaguar_heartbeat(JaguarConnection *conn, uint8_t device, 
+        uint32_t period_us)
+{
+    struct itimerspec timer;
+    uint64_t wakeup;
+    int fd;
+
+    if (period_us == 0) {
+        return JAGUAR_ERROR;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    // a timer the owner has yet to close is simply armed again
+    conn->heartbeat_stop = false;
+    fd = conn->heartbeat_fd;
+    if (fd < 0) {
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            pthread_mutex_unlock(&conn->lock);
+            return JAGUAR_ERROR;
+        }
+    }
+
+    conn->heartbeat_device = device;
+    conn->heartbeat_period_us = period_us;
+    memset(&conn->heartbeat_stats, 0, sizeof(JaguarHeartbeatStats));
+
+    timer.it_interval.tv_sec = period_us / 1000000;
+    timer.it_interval.tv_nsec = (period_us % 1000000) * 1000;
+    timer.it_value = timer.it_interval;
+    conn->heartbeat_next_us = jaguar_time_us() + period_us;
+    timerfd_settime(fd, 0, &timer, NULL);
+    __atomic_store_n(&conn->heartbeat_fd, fd, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->lock);
+
+    // make a waiting io thread pick up the new timer
+    wakeup = 1;
+    write(conn->wake_fd, &wakeup, sizeof(wakeup));
+
+    return JAGUAR_OK;
+}
+
+// Disarm the heartbeat timer. The owner of the connection may be polling 
+// or reading it, so it is only closed here when there is no owner, the 
+// owner closes it otherwise once woken.
+int stop_jaguar_heartbeat(JaguarConnection *conn)
+{
+    struct itimerspec timer;
+    uint64_t wakeup;
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->heartbeat_fd < 0) {
+        pthread_mutex_unlock(&conn->lock);
+        return JAGUAR_OK;
+    }
+
+    if (!conn->io_running) {
+        close(conn->heartbeat_fd);
+        conn->heartbeat_fd = -1;
+        conn->heartbeat_stop = false;
+        pthread_mutex_unlock(&conn->lock);
+        return JAGUAR_OK;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    timerfd_settime(conn->heartbeat_fd, 0, &timer, NULL);
+    __atomic_store_n(&conn->heartbeat_stop, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->lock);
+
+    // make a waiting io thread drop the timer
+    wakeup = 1;
+    write(conn->wake_fd, &wakeup, sizeof(wakeup));
+
+    return JAGUAR_OK;
+}
+
+// Send the heartbeat if the timer has expired. Called automatically while 
+// waiting for input, or from an application event loop polling heartbeat_fd.
+int service_jaguar_heartbeat(JaguarConnection *conn)
+{
+    JaguarHeartbeatStats *stats;
+    uint64_t expirations;
+    uint64_t now;
+    uint32_t jitter;
+    uint8_t device;
+    int fd;
+
+    reap_heartbeat(conn);
+    fd = __atomic_load_n(&conn->heartbeat_fd, __ATOMIC_ACQUIRE);
+    if (fd < 0 || read(fd, &expirations, sizeof(expirations)) 
+            != sizeof(expirations)) {
+        return JAGUAR_OK;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    device = conn->heartbeat_device;
+    pthread_mutex_unlock(&conn->lock);
+    sys_heartbeat(conn, device);
+
+    pthread_mutex_lock(&conn->lock);
+    now = jaguar_time_us();
+    jitter = now > conn->heartbeat_next_us 
+            ? (uint32_t) (now - conn->heartbeat_next_us) : 0;
+    conn->heartbeat_next_us += expirations * conn->heartbeat_period_us;
+
+    stats = &conn->heartbeat_stats;
+    stats->sent += 1;
+    stats->missed += expirations - 1;
+    stats->last_jitter_us = jitter;
+    stats->total_jitter_us += jitter;
+    if (jitter > stats->max_jitter_us) {
+        stats->max_jitter_us = jitter;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return JAGUAR_OK;
+}
+
+int get_jaguar_heartbeat_stats(JaguarConnection *conn, 
+        JaguarHeartbeatStats *stats)
+{
+    pthread_mutex_lock(&conn->lock);
+    *stats = conn->heartbeat_stats;
+    pthread_mutex_unlock(&conn->lock);
+    return JAGUAR_OK;
+}
+
+// Copy or clear counters one at a time. Each counter is read atomically 
+// but a snapshot is not taken at a single instant, which is close enough 
+// for monitoring and never stalls the connection.
+static void load_counters(uint64_t *to, uint64_t *from, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void clear_counters(uint64_t *counters, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+int get_jaguar_stats(JaguarConnection *conn, JaguarStats *stats)
+{
+    load_counters((uint64_t *) stats, (uint64_t *) &conn->stats, 
+            sizeof(JaguarStats));
+    return JAGUAR_OK;
+}
+
+int get_jaguar_device_stats(JaguarConnection *conn, uint8_t device, 
+        JaguarDeviceStats *stats)
+{
+    if (device >= JAGUAR_MAX_DEVICES) {
+        return JAGUAR_ERROR;
+    }
+
+    load_counters((uint64_t *) stats, (uint64_t *) &conn->device_stats[device],
+            sizeof(JaguarDeviceStats));
+    return JAGUAR_OK;
+}
+
+int reset_jaguar_stats(JaguarConnection *conn)
+{
+    clear_counters((uint64_t *) &conn->stats, sizeof(conn->stats));
+    clear_counters((uint64_t *) conn->device_stats, 
+            sizeof(conn->device_stats));
+    return JAGUAR_OK;
+}
+
+int sys_halt_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_HALT);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_halt(JaguarConnection *conn, uint8_t device)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_HALT);
+    message.device = device;
+    message.data_size = 0;
+    return send_can_message(conn, &message);
+}
+
+int sys_reset_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_RESET);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_reset(JaguarConnection *conn, uint8_t device)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_RESET);
+    message.device = device;
+    message.data_size = 0;
+    return send_can_message(conn, &message);
+}
+
+int sys_resume_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_RESUME);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_resume(JaguarConnection *conn, uint8_t device)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_RESUME);
+    message.device = device;
+    message.data_size = 0;
+    return send_can_message(conn, &message);
+}
+
+// Ask every device on the bus to announce itself, see 
+// enumerate_jaguar_devices()
+int sys_enumerate(JaguarConnection *conn)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_ENUMERATION);
+    message.device = 0;
+    message.data_size = 0;
+    return send_can_message(conn, &message);
+}
+
+int sys_enumerate_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_ENUMERATION);
+    message.device = 0;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 0, callback, context);
+}
+
+int sys_firmware_version_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_sys_message(&message, SYS_FW_VER);
+    message.device = device;
+    message.data_size = 0;
+
+    // system messages are answered but never acknowledged
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_REPLY, callback, 
+            context);
+}
+
+int sys_firmware_version(JaguarConnection *conn, uint8_t device, 
+        uint32_t *version)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            sys_firmware_version_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    return get_reply_uint32(&tx, version);
+}
+
+// Read the firmware versions of the found devices, keeping a batch of 
+// requests in flight instead of asking one device at a time
+static void fetch_firmware_versions(JaguarConnection *conn, 
+        const uint8_t *found, int found_count)
+{
+    JaguarTransaction txs[JAGUAR_ENUMERATION_BATCH];
+    uint32_t version;
+    int batch;
+    int start;
+    int i;
+
+    for (start = 0; start < found_count; start += batch) {
+        batch = found_count - start;
+        if (batch > JAGUAR_ENUMERATION_BATCH) {
+            batch = JAGUAR_ENUMERATION_BATCH;
+        }
+        for (i = 0; i < batch; i++) {
+            sys_firmware_version_async(conn, &txs[i], found[start + i], 
+                    NULL, NULL);
+        }
+        wait_jaguar_transactions(conn, txs, batch);
+
+        pthread_mutex_lock(&conn->lock);
+        for (i = 0; i < batch; i++) {
+            if (get_reply_uint32(&txs[i], &version) == JAGUAR_OK) {
+                conn->devices[found[start + i]].firmware_version = version;
+            }
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+// Find the devices on the bus and read their firmware versions. One 
+// enumeration broadcast is answered by every device within window_us, 0 
+// for JAGUAR_ENUMERATION_WINDOW_US, then the versions are requested from 
+// all found devices in parallel. The result replaces conn->devices and is 
+// copied to devices, indexed by device number, unless it is NULL. count 
+// receives the number of devices found.
+int enumerate_jaguar_devices(JaguarConnection *conn, uint32_t window_us, 
+        JaguarDeviceInfo *devices, int *count)
+{
+    uint8_t found[JAGUAR_MAX_DEVICES];
+    struct timespec deadline;
+    uint64_t deadline_us;
+    int found_count;
+    int i;
+
+    if (window_us == 0) {
+        window_us = JAGUAR_ENUMERATION_WINDOW_US;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    memset(conn->devices, 0, sizeof(conn->devices));
+    pthread_mutex_unlock(&conn->lock);
+
+    deadline_us = jaguar_time_us() + window_us;
+    sys_enumerate(conn);
+
+    // collect the answers, handle_message records them in the table
+    if (conn->io_running) {
+        deadline.tv_sec = deadline_us / 1000000;
+        deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 
+                NULL) == EINTR) {
+        }
+    } else {
+        while (jaguar_time_us() < deadline_us) {
+            if (process_jaguar_messages(conn, deadline_us) == JAGUAR_ERROR) {
+                return JAGUAR_ERROR;
+            }
+        }
+    }
+
+    found_count = 0;
+    pthread_mutex_lock(&conn->lock);
+    for (i = 1; i < JAGUAR_MAX_DEVICES; i++) {
+        if (conn->devices[i].present) {
+            found[found_count] = (uint8_t) i;
+            found_count += 1;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    fetch_firmware_versions(conn, found, found_count);
+
+    if (devices != NULL) {
+        pthread_mutex_lock(&conn->lock);
+        memcpy(devices, conn->devices, sizeof(conn->devices));
+        pthread_mutex_unlock(&conn->lock);
+    }
+    if (count != NULL) {
+        *count = found_count;
+    }
+
+    return JAGUAR_OK;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Self-test of the serial path: time count firmware version requests to 
+// device, one at a time, and report what the round trips took. The request 
+// and its reply are single small frames that devices answer without 
+// touching the motor, so the result is the latency of the port, adapter 
+// and bus rather than of the controller.
+int measure_jaguar_latency(JaguarConnection *conn, uint8_t device, 
+        int count, JaguarLatencyReport *report)
+{
+    uint32_t samples[JAGUAR_SELF_TEST_MAX];
+    uint32_t version;
+    uint64_t start;
+    uint64_t total;
+    int n;
+    int i;
+
+    if (count <= 0 || count > JAGUAR_SELF_TEST_MAX) {
+        return JAGUAR_ERROR;
+    }
+
+    memset(report, 0, sizeof(JaguarLatencyReport));
+    n = 0;
+    total = 0;
+    for (i = 0; i < count; i++) {
+        start = jaguar_time_us();
+        if (sys_firmware_version(conn, device, &version) != JAGUAR_OK) {
+            report->failures += 1;
+            continue;
+        }
+        samples[n] = (uint32_t) (jaguar_time_us() - start);
+        total += samples[n];
+        n += 1;
+    }
+
+    report->samples = n;
+    if (n == 0) {
+        return JAGUAR_TIMEOUT;
+    }
+    qsort(samples, (size_t) n, sizeof(uint32_t), compare_uint32);
+    report->min_us = samples[0];
+    report->median_us = samples[n / 2];
+    report->p99_us = samples[(n * 99) / 100];
+    report->max_us = samples[n - 1];
+    report->mean_us = (uint32_t) (total / (uint64_t) n);
+
+    return JAGUAR_OK;
+}
+
+// Open serial_port at baud with each predefined profile in turn and 
+// measure the round trips it achieves. reports is indexed by profile, a 
+// profile whose connection could not be opened reports no samples.
+int compare_jaguar_serial_profiles(const char *serial_port, uint32_t baud, 
+        uint8_t device, int count, 
+        JaguarLatencyReport reports[JAGUAR_SERIAL_PROFILES])
+{
+    JaguarConnection *conn;
+    JaguarSerialOptions options;
+    int profile;
+    int result;
+
+    // keep the large connection state off the stack
+    conn = malloc(sizeof(JaguarConnection));
+    if (conn == NULL) {
+        return JAGUAR_ERROR;
+    }
+
+    result = JAGUAR_OK;
+    for (profile = 0; profile < JAGUAR_SERIAL_PROFILES; profile++) {
+        memset(&reports[profile], 0, sizeof(JaguarLatencyReport));
+        options.baud = baud;
+        set_jaguar_serial_profile(&options, profile);
+        if (open_jaguar_connection_options(conn, serial_port, &options) 
+                != 0) {
+            result = JAGUAR_ERROR;
+            continue;
+        }
+        if (measure_jaguar_latency(conn, device, count, &reports[profile]) 
+                != JAGUAR_OK) {
+            result = JAGUAR_ERROR;
+        }
+        close_jaguar_connection(conn);
+    }
+    free(conn);
+
+    return result;
+}
+
+int status_output_percent_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_jaguar_message(&message, API_STATUS, STATUS_OUTPUT_PERCENT);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int status_output_percent(JaguarConnection *conn, uint8_t device, 
+        int16_t *output_percent)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            status_output_percent_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    return get_reply_int16(&tx, output_percent);
+}
+
+int status_temperature_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_jaguar_message(&message, API_STATUS, STATUS_TEMPERATURE);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int status_temperature(JaguarConnection *conn, uint8_t device, 
+        uint16_t *temperature)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            status_temperature_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    return get_reply_uint16(&tx, temperature);
+}
+
+int status_position_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_jaguar_message(&message, API_STATUS, STATUS_POSITION);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int status_position(JaguarConnection *conn, uint8_t device, uint32_t *position)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            status_position_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    return get_reply_uint32(&tx, position);
+}
+
+int status_mode_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    init_jaguar_message(&message, API_STATUS, STATUS_MODE);
+    message.device = device;
+    message.data_size = 0;
+
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int status_mode(JaguarConnection *conn, uint8_t device, uint8_t *mode)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            status_mode_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    return get_reply_uint8(&tx, mode);
+}
+
+// Copy the telemetry of a device if the requested value is no older than 
+// max_age_us, otherwise ask the device for it first
+int get_jaguar_telemetry(JaguarConnection *conn, uint8_t device, 
+        uint8_t status_index, uint32_t max_age_us, JaguarTelemetry *telemetry)
+{
+    JaguarTelemetry *cached;
+    JaguarTransaction tx;
+    CANMessage message;
+    uint64_t updated;
+    int result;
+
+    if (status_index >= STATUS_FIELDS) {
+        return JAGUAR_ERROR;
+    }
+
+    cached = &conn->telemetry[device & 0x3F];
+    pthread_mutex_lock(&conn->lock);
+    updated = cached->updated_us[status_index];
+    if (updated != 0 && jaguar_time_us() - updated <= max_age_us) {
+        *telemetry = *cached;
+        pthread_mutex_unlock(&conn->lock);
+        return JAGUAR_OK;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    // stale, refresh over the bus, the reply updates the cache
+    init_jaguar_message(&message, API_STATUS, status_index);
+    message.device = device;
+    message.data_size = 0;
+    result = await_transaction(conn, &tx, submit_request(conn, &tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    *telemetry = *cached;
+    pthread_mutex_unlock(&conn->lock);
+
+    return JAGUAR_OK;
+}
+
+int status_output_percent_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, int16_t *output_percent)
+{
+    JaguarTelemetry telemetry;
+    int result;
+
+    result = get_jaguar_telemetry(conn, device, STATUS_OUTPUT_PERCENT, 
+            max_age_us, &telemetry);
+    if (result == JAGUAR_OK) {
+        *output_percent = telemetry.output_percent;
+    }
+
+    return result;
+}
+
+int status_temperature_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint16_t *temperature)
+{
+    JaguarTelemetry telemetry;
+    int result;
+
+    result = get_jaguar_telemetry(conn, device, STATUS_TEMPERATURE, 
+            max_age_us, &telemetry);
+    if (result == JAGUAR_OK) {
+        *temperature = telemetry.temperature;
+    }
+
+    return result;
 }
 
-int sys_resume(JaguarConnection *conn, uint8_t device)
+int status_position_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint32_t *position)
 {
-    CANMessage message;
-    init_sys_message(&message, SYS_RESUME);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
+    JaguarTelemetry telemetry;
+    int result;
 
-    return 0;
+    result = get_jaguar_telemetry(conn, device, STATUS_POSITION, 
+            max_age_us, &telemetry);
+    if (result == JAGUAR_OK) {
+        *position = (uint32_t) telemetry.position;
+    }
+
+    return result;
 }
 
-int status_output_percent(JaguarConnection *conn, uint8_t device, 
-        int16_t *output_percent)
+int status_mode_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint8_t *mode)
 {
-    CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
-    init_jaguar_message(&message, API_STATUS, STATUS_OUTPUT_PERCENT);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
+    JaguarTelemetry telemetry;
+    int result;
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *output_percent = reply.data[0] | reply.data[1] << 8;
-        return 0;
-    } else {
-        return 1;
+    result = get_jaguar_telemetry(conn, device, STATUS_MODE, 
+            max_age_us, &telemetry);
+    if (result == JAGUAR_OK) {
+        *mode = telemetry.mode;
     }
+
+    return result;
 }
 
-int status_temperature(JaguarConnection *conn, uint8_t device, 
-        uint16_t *temperature)
+// Convert a status snapshot to engineering units. Voltages, current and 
+// temperature are 8.8 fixed point, bus voltage and temperature unsigned, 
+// position and speed signed 16.16. Output is a fraction of 32767.
+int convert_jaguar_telemetry(const JaguarTelemetry *telemetry, 
+        JaguarTelemetryUnits *units)
 {
-    CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
-    init_jaguar_message(&message, API_STATUS, STATUS_TEMPERATURE);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
+    units->output_percent = telemetry->output_percent * (100.0 / 32767.0);
+    units->bus_volts = telemetry->bus_voltage * (1.0 / 256.0);
+    units->current_amps = telemetry->current * (1.0 / 256.0);
+    units->temperature_c = telemetry->temperature * (1.0 / 256.0);
+    units->position_rev = telemetry->position * (1.0 / 65536.0);
+    units->speed_rpm = telemetry->speed * (1.0 / 65536.0);
+    units->output_volts = telemetry->output_volts * (1.0 / 256.0);
+    units->limit = telemetry->limit;
+    units->fault = telemetry->fault;
+    units->power = telemetry->power;
+    units->mode = telemetry->mode;
+    memcpy(units->updated_us, telemetry->updated_us, 
+            sizeof(units->updated_us));
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *temperature = reply.data[0] | reply.data[1] << 8;
-        return 0;
-    } else {
-        return 1;
-    }
+    return JAGUAR_OK;
 }
 
-int status_position(JaguarConnection *conn, uint8_t device, uint32_t *position)
+// Take the cached status of several devices at once, in engineering units. 
+// The snapshots are copied under one hold of the lock, so they are 
+// consistent with each other, and converted after it is released. Nothing 
+// is requested over the bus, updated_us tells how fresh each value is.
+int get_jaguar_telemetry_units(JaguarConnection *conn, 
+        const uint8_t *devices, int count, JaguarTelemetryUnits *units)
 {
-    CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
-    init_jaguar_message(&message, API_STATUS, STATUS_POSITION);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
+    JaguarTelemetry snapshot[JAGUAR_MAX_DEVICES];
+    int i;
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *position = reply.data[0] | reply.data[1] << 8 | reply.data[2] << 16 
-            | reply.data[3] << 24;
-        return 0;
-    } else {
-        return 1;
+    if (count < 0 || count > JAGUAR_MAX_DEVICES) {
+        return JAGUAR_ERROR;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    for (i = 0; i < count; i++) {
+        snapshot[i] = conn->telemetry[devices[i] & 0x3F];
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    for (i = 0; i < count; i++) {
+        convert_jaguar_telemetry(&snapshot[i], &units[i]);
     }
+
+    return JAGUAR_OK;
 }
 
-int status_mode(JaguarConnection *conn, uint8_t device, uint8_t *mode)
+int voltage_enable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
-    init_jaguar_message(&message, API_STATUS, STATUS_MODE);
+    init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_ENABLE);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *mode = reply.data[0];
-        return 0;
-    } else {
-        return 1;
-    }
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
 int voltage_enable(JaguarConnection *conn, uint8_t device)
 {
-    CANMessage message;
-    CANMessage ack;
-    init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_ENABLE);
-    message.device = device;
-    message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
+    JaguarTransaction tx;
 
-    return 1 - valid_ack(&message, &ack);
+    return await_transaction(conn, &tx, 
+            voltage_enable_async(conn, &tx, device, NULL, NULL));
 }
 
-int voltage_disable(JaguarConnection *conn, uint8_t device)
+int voltage_disable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_DISABLE);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int voltage_set(JaguarConnection *conn, uint8_t device, int16_t voltage)
+int voltage_disable(JaguarConnection *conn, uint8_t device)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            voltage_disable_async(conn, &tx, device, NULL, NULL));
+}
+
+int voltage_set_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int16_t voltage, JaguarCompletion callback, 
+        void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_SET);
     message.device = device;
     message.data_size = 2;
     message.data[0] = (uint8_t) (voltage & 0x00ff);
     message.data[1] = (uint8_t) (voltage >> 8);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int voltage_set_sync(JaguarConnection *conn, uint8_t device, int16_t voltage, 
-        uint8_t group)
+int voltage_set(JaguarConnection *conn, uint8_t device, int16_t voltage)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            voltage_set_async(conn, &tx, device, voltage, NULL, NULL));
+}
+
+int voltage_set_sync_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int16_t voltage, uint8_t group, 
+        JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_SET);
     message.device = device;
     message.data_size = 3;
     message.data[0] = (uint8_t) (voltage & 0x00ff);
     message.data[1] = (uint8_t) (voltage >> 8);
     message.data[2] = group;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int voltage_get(JaguarConnection *conn, uint8_t device, int16_t *voltage)
+int voltage_set_sync(JaguarConnection *conn, uint8_t device, int16_t voltage, 
+        uint8_t group)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            voltage_set_sync_async(conn, &tx, device, voltage, group, NULL, 
+                    NULL));
+}
+
+// Send every setpoint of a batch and the sync update for its group in one
+// write, then collect the acknowledgements together. With an io owner the 
+// batch is queued as one unit, so the owner schedules and sends it whole. 
+// An empty batch sends nothing, not even the sync update, since no 
+// setpoint of the group was set by it.
+static int set_sync_batch(JaguarConnection *conn, CANMessage *messages, 
+        JaguarSetpoint *setpoints, int count, uint8_t group)
+{
+    JaguarTransaction txs[JAGUAR_MAX_PENDING + 1];
+    uint64_t deadline;
+    bool queued;
+    int added;
+    int result;
+    int i;
+
+    if (count == 0) {
+        return JAGUAR_OK;
+    }
+    if (count > JAGUAR_MAX_PENDING) {
+        // more than can be in flight at once
+        for (i = 0; i < count; i++) {
+            setpoints[i].result = JAGUAR_BUSY;
+        }
+        return JAGUAR_BUSY;
+    }
+
+    // trailing sync update, never acknowledged
+    init_sys_message(&messages[count], SYS_SYNC_UPDATE);
+    messages[count].device = 0;
+    messages[count].data_size = 1;
+    messages[count].data[0] = group;
+
+    deadline = jaguar_time_us() + conn->timeout_us;
+    if (conn->io_running) {
+        for (i = 0; i < count; i++) {
+            init_jaguar_transaction(&txs[i], &messages[i], 
+                    JAGUAR_EXPECT_ACK);
+            txs[i].deadline_us = deadline;
+        }
+        init_jaguar_transaction(&txs[count], &messages[count], 0);
+        txs[count].deadline_us = deadline;
+        queue_submissions(conn, txs, count + 1);
+        result = wait_jaguar_transactions(conn, txs, count + 1);
+        for (i = 0; i < count; i++) {
+            setpoints[i].result = txs[i].status;
+        }
+        return result;
+    }
+
+    for (added = 0; added < count; added++) {
+        init_jaguar_transaction(&txs[added], &messages[added], 
+                JAGUAR_EXPECT_ACK);
+        txs[added].deadline_us = deadline;
+        result = add_pending(conn, &txs[added]);
+        if (result != JAGUAR_OK) {
+            break;
+        }
+    }
+
+    queued = false;
+    if (added == count) {
+        result = send_frames(conn, messages, count + 1, &queued);
+    }
+
+    if (!queued) {
+        // nothing will answer what was not sent, withdraw what was 
+        // registered. Frames that are queued but still waiting for the 
+        // port are answered or time out like the rest.
+        for (i = 0; i < added; i++) {
+            withdraw_pending(conn, &txs[i], result);
+        }
+        for (i = 0; i < count; i++) {
+            setpoints[i].result = i < added ? txs[i].status : result;
+        }
+        return result;
+    }
+
+    result = wait_jaguar_transactions(conn, txs, count);
+    for (i = 0; i < count; i++) {
+        setpoints[i].result = txs[i].status;
+    }
+
+    return result;
+}
+
+int voltage_set_sync_batch(JaguarConnection *conn, JaguarSetpoint *setpoints,
+        int count, uint8_t group)
+{
+    CANMessage messages[JAGUAR_MAX_PENDING + 1];
+    int i;
+
+    if (count < 0) {
+        return JAGUAR_ERROR;
+    }
+    for (i = 0; i < count && i < JAGUAR_MAX_PENDING; i++) {
+        init_jaguar_message(&messages[i], API_VOLTAGE, VOLTAGE_SET);
+        messages[i].device = setpoints[i].device;
+        messages[i].data_size = 3;
+        messages[i].data[0] = (uint8_t) (setpoints[i].value & 0x00ff);
+        messages[i].data[1] = (uint8_t) (setpoints[i].value >> 8 & 0x00ff);
+        messages[i].data[2] = group;
+    }
+
+    return set_sync_batch(conn, messages, setpoints, count, group);
+}
+
+int voltage_get_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
     init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_SET);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *voltage = reply.data[0] | reply.data[1] << 8;
-        return 0;
-    } else {
-        return 1;
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int voltage_get(JaguarConnection *conn, uint8_t device, int16_t *voltage)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            voltage_get_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
     }
+
+    return get_reply_int16(&tx, voltage);
 }
 
-int voltage_ramp(JaguarConnection *conn, uint8_t device, uint16_t ramp)
+int voltage_ramp_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint16_t ramp, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_VOLTAGE, VOLTAGE_RAMP);
     message.device = device;
     message.data_size = 2;
     message.data[0] = (uint8_t) (ramp & 0x00ff);
     message.data[1] = (uint8_t) (ramp >> 8);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_enable(JaguarConnection *conn, uint8_t device, int32_t position)
+int voltage_ramp(JaguarConnection *conn, uint8_t device, uint16_t ramp)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            voltage_ramp_async(conn, &tx, device, ramp, NULL, NULL));
+}
+
+int position_enable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, JaguarCompletion callback, 
+        void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_ENABLE);
     message.device = device;
     message.data_size = 4;
@@ -407,29 +4099,44 @@ int position_enable(JaguarConnection *conn, uint8_t device, int32_t position)
     message.data[1] = (uint8_t) (position >> 8 & 0x000000ff);
     message.data[2] = (uint8_t) (position >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (position >> 24);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_disable(JaguarConnection *conn, uint8_t device)
+int position_enable(JaguarConnection *conn, uint8_t device, int32_t position)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_enable_async(conn, &tx, device, position, NULL, NULL));
+}
+
+int position_disable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_DISABLE);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_set(JaguarConnection *conn, uint8_t device, int32_t position)
+int position_disable(JaguarConnection *conn, uint8_t device)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_disable_async(conn, &tx, device, NULL, NULL));
+}
+
+int position_set_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, JaguarCompletion callback, 
+        void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_SET);
     message.device = device;
     message.data_size = 4;
@@ -437,17 +4144,24 @@ int position_set(JaguarConnection *conn, uint8_t device, int32_t position)
     message.data[1] = (uint8_t) (position >> 8 & 0x000000ff);
     message.data[2] = (uint8_t) (position >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (position >> 24);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_set_sync(JaguarConnection *conn, uint8_t device, int32_t position,
-        uint8_t group)
+int position_set(JaguarConnection *conn, uint8_t device, int32_t position)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_set_async(conn, &tx, device, position, NULL, NULL));
+}
+
+int position_set_sync_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, uint8_t group, 
+        JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_SET);
     message.device = device;
     message.data_size = 5;
@@ -456,51 +4170,95 @@ int position_set_sync(JaguarConnection *conn, uint8_t device, int32_t position,
     message.data[2] = (uint8_t) (position >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (position >> 24);
     message.data[4] = group;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_get(JaguarConnection *conn, uint8_t device, int32_t *position)
+int position_set_sync(JaguarConnection *conn, uint8_t device, int32_t position,
+        uint8_t group)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_set_sync_async(conn, &tx, device, position, group, NULL, 
+                    NULL));
+}
+
+int position_set_sync_batch(JaguarConnection *conn, JaguarSetpoint *setpoints,
+        int count, uint8_t group)
+{
+    CANMessage messages[JAGUAR_MAX_PENDING + 1];
+    int i;
+
+    if (count < 0) {
+        return JAGUAR_ERROR;
+    }
+    for (i = 0; i < count && i < JAGUAR_MAX_PENDING; i++) {
+        init_jaguar_message(&messages[i], API_POSITION, POSITION_SET);
+        messages[i].device = setpoints[i].device;
+        messages[i].data_size = 5;
+        messages[i].data[0] = (uint8_t) (setpoints[i].value & 0x000000ff);
+        messages[i].data[1] = (uint8_t) (setpoints[i].value >> 8 & 0x000000ff);
+        messages[i].data[2] = (uint8_t) (setpoints[i].value >> 16 & 0x000000ff);
+        messages[i].data[3] = (uint8_t) (setpoints[i].value >> 24);
+        messages[i].data[4] = group;
+    }
+
+    return set_sync_batch(conn, messages, setpoints, count, group);
+}
+
+int position_get_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage reply;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_SET);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    recieve_can_message(conn, &ack);
 
-    if (valid_jaguar_reply(&message, &reply) && valid_ack(&message, &ack)) {
-        *position = reply.data[0] | reply.data[1] << 8 | reply.data[2] << 16 
-            | reply.data[3] << 24;
-        return 0;
-    } else {
-        return 1;
+    return submit_request(conn, tx, &message, 
+            JAGUAR_EXPECT_REPLY | JAGUAR_EXPECT_ACK, callback, context);
+}
+
+int position_get(JaguarConnection *conn, uint8_t device, int32_t *position)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            position_get_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
     }
+
+    return get_reply_int32(&tx, position);
 }
 
-int position_ref_encoder(JaguarConnection *conn, uint8_t device)
+int position_ref_encoder_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_REF);
     message.device = device;
     message.data_size = 1;
     message.data[0] = (uint8_t) POSITION_ENCODER;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_p(JaguarConnection *conn, uint8_t device, int32_t p)
+int position_ref_encoder(JaguarConnection *conn, uint8_t device)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_ref_encoder_async(conn, &tx, device, NULL, NULL));
+}
+
+int position_p_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t p, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_P);
     message.device = device;
     message.data_size = 4;
@@ -508,16 +4266,23 @@ int position_p(JaguarConnection *conn, uint8_t device, int32_t p)
     message.data[1] = (uint8_t) (p >> 8 & 0x000000ff);
     message.data[2] = (uint8_t) (p >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (p >> 24);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_i(JaguarConnection *conn, uint8_t device, int32_t i)
+int position_p(JaguarConnection *conn, uint8_t device, int32_t p)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_p_async(conn, &tx, device, p, NULL, NULL));
+}
+
+int position_i_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t i, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_I);
     message.device = device;
     message.data_size = 4;
@@ -525,16 +4290,23 @@ int position_i(JaguarConnection *conn, uint8_t device, int32_t i)
     message.data[1] = (uint8_t) (i >> 8 & 0x000000ff);
     message.data[2] = (uint8_t) (i >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (i >> 24);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int position_d(JaguarConnection *conn, uint8_t device, int32_t d)
+int position_i(JaguarConnection *conn, uint8_t device, int32_t i)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_i_async(conn, &tx, device, i, NULL, NULL));
+}
+
+int position_d_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t d, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_POSITION, POSITION_D);
     message.device = device;
     message.data_size = 4;
@@ -542,49 +4314,271 @@ int position_d(JaguarConnection *conn, uint8_t device, int32_t d)
     message.data[1] = (uint8_t) (d >> 8 & 0x000000ff);
     message.data[2] = (uint8_t) (d >> 16 & 0x000000ff);
     message.data[3] = (uint8_t) (d >> 24);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
+}
+
+int position_d(JaguarConnection *conn, uint8_t device, int32_t d)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            position_d_async(conn, &tx, device, d, NULL, NULL));
+}
+
+// Set all three gains of the position loop. txs holds one transaction per 
+// gain, P, I and D in that order, each completing on its own. With an io 
+// owner the three are queued as one unit and go out together.
+int position_pid_async(JaguarConnection *conn, JaguarTransaction *txs, 
+        uint8_t device, int32_t p, int32_t i, int32_t d, 
+        JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    int32_t gains[3];
+    int result;
+    int n;
+
+    gains[0] = p;
+    gains[1] = i;
+    gains[2] = d;
+    for (n = 0; n < 3; n++) {
+        init_jaguar_message(&message, API_POSITION, POSITION_P + n);
+        message.device = device;
+        message.data_size = 4;
+        message.data[0] = (uint8_t) (gains[n] & 0x000000ff);
+        message.data[1] = (uint8_t) (gains[n] >> 8 & 0x000000ff);
+        message.data[2] = (uint8_t) (gains[n] >> 16 & 0x000000ff);
+        message.data[3] = (uint8_t) (gains[n] >> 24);
+        init_jaguar_transaction(&txs[n], &message, JAGUAR_EXPECT_ACK);
+        txs[n].callback = callback;
+        txs[n].context = context;
+    }
+
+    if (conn->io_running) {
+        return queue_submissions(conn, txs, 3);
+    }
+
+    for (n = 0; n < 3; n++) {
+        result = submit_jaguar_transaction(conn, &txs[n]);
+        if (result != JAGUAR_OK) {
+            // the gains not sent fail with the one that could not be
+            for (; n < 3; n++) {
+                txs[n].status = result;
+            }
+            return result;
+        }
+    }
+
+    return JAGUAR_OK;
 }
 
 int position_pid(JaguarConnection *conn, uint8_t device, int32_t p, int32_t i, 
         int32_t d)
 {
-    return position_p(conn, device, p) | position_i(conn, device, i) | 
-        position_d(conn, device, d);
+    JaguarTransaction txs[3];
+
+    // a gain that could not be sent carries the failure, the others are 
+    // still waited for
+    position_pid_async(conn, txs, device, p, i, d, NULL, NULL);
+    return wait_jaguar_transactions(conn, txs, 3);
 }
 
-int config_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t lines)
+// Set the data layout of one of the four periodic status messages of a 
+// device, layout holds one PSTAT_ code per data byte. The messages the 
+// device pushes are decoded with it once it is acknowledged.
+int pstat_config_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint8_t index, const uint8_t *layout, 
+        JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+    int i;
+
+    if (index >= PSTAT_MESSAGES) {
+        return JAGUAR_ERROR;
+    }
+
+    init_jaguar_message(&message, API_PSTAT, PSTAT_CFG_S0 + index);
+    message.device = device;
+    message.data_size = MAX_DATA_BYTES;
+    for (i = 0; i < MAX_DATA_BYTES; i++) {
+        message.data[i] = layout[i];
+    }
+
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
+}
+
+int pstat_config(JaguarConnection *conn, uint8_t device, uint8_t index, 
+        const uint8_t *layout)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            pstat_config_async(conn, &tx, device, index, layout, NULL, NULL));
+}
+
+// Set how often a device sends one of its periodic status messages, a 
+// period of 0 stops it
+int pstat_period_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint8_t index, uint16_t period_ms, 
+        JaguarCompletion callback, void *context)
+{
+    CANMessage message;
+
+    if (index >= PSTAT_MESSAGES) {
+        return JAGUAR_ERROR;
+    }
+
+    init_jaguar_message(&message, API_PSTAT, PSTAT_PER_EN_S0 + index);
+    message.device = device;
+    message.data_size = 2;
+    message.data[0] = (uint8_t) (period_ms & 0x00ff);
+    message.data[1] = (uint8_t) (period_ms >> 8);
+
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
+}
+
+int pstat_period(JaguarConnection *conn, uint8_t device, uint8_t index, 
+        uint16_t period_ms)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            pstat_period_async(conn, &tx, device, index, period_ms, NULL, 
+                    NULL));
+}
+
+// Replace byte n of a little endian value
+#define SET_BYTE(field, n, byte) \
+    ((field) = (__typeof__(field)) (((uint32_t) (field) \
+            & ~((uint32_t) 0xff << (8 * (n)))) | (uint32_t) (byte) << (8 * (n))))
+
+// Unpack a periodic status message into a telemetry record according to 
+// the layout it was configured with
+int decode_periodic_status(const uint8_t *layout, CANMessage *message, 
+        JaguarTelemetry *telemetry, uint64_t now)
+{
+    uint16_t updated;
+    uint8_t byte;
+    int i;
+
+    updated = 0;
+    for (i = 0; i < message->data_size && layout[i] != PSTAT_END; i++) {
+        byte = message->data[i];
+        switch (layout[i]) {
+        case PSTAT_VOLTOUT_B0:
+        case PSTAT_VOLTOUT_B1:
+            SET_BYTE(telemetry->output_percent, layout[i] - PSTAT_VOLTOUT_B0, 
+                    byte);
+            updated |= 1 << STATUS_OUTPUT_PERCENT;
+            break;
+        case PSTAT_VOLTBUS_B0:
+        case PSTAT_VOLTBUS_B1:
+            SET_BYTE(telemetry->bus_voltage, layout[i] - PSTAT_VOLTBUS_B0, 
+                    byte);
+            updated |= 1 << STATUS_BUS_VOLTAGE;
+            break;
+        case PSTAT_CURRENT_B0:
+        case PSTAT_CURRENT_B1:
+            SET_BYTE(telemetry->current, layout[i] - PSTAT_CURRENT_B0, byte);
+            updated |= 1 << STATUS_CURRENT;
+            break;
+        case PSTAT_TEMP_B0:
+        case PSTAT_TEMP_B1:
+            SET_BYTE(telemetry->temperature, layout[i] - PSTAT_TEMP_B0, byte);
+            updated |= 1 << STATUS_TEMPERATURE;
+            break;
+        case PSTAT_POS_B0:
+        case PSTAT_POS_B1:
+        case PSTAT_POS_B2:
+        case PSTAT_POS_B3:
+            SET_BYTE(telemetry->position, layout[i] - PSTAT_POS_B0, byte);
+            updated |= 1 << STATUS_POSITION;
+            break;
+        case PSTAT_SPD_B0:
+        case PSTAT_SPD_B1:
+        case PSTAT_SPD_B2:
+        case PSTAT_SPD_B3:
+            SET_BYTE(telemetry->speed, layout[i] - PSTAT_SPD_B0, byte);
+            updated |= 1 << STATUS_SPEED;
+            break;
+        case PSTAT_LIMIT_NCLR:
+        case PSTAT_LIMIT_CLR:
+            telemetry->limit = byte;
+            updated |= 1 << STATUS_LIMIT;
+            break;
+        case PSTAT_FAULT:
+            telemetry->fault = byte;
+            updated |= 1 << STATUS_FAULT;
+            break;
+        case PSTAT_VOUT_B0:
+        case PSTAT_VOUT_B1:
+            SET_BYTE(telemetry->output_volts, layout[i] - PSTAT_VOUT_B0, byte);
+            updated |= 1 << STATUS_OUTPUT_VOLTS;
+            break;
+        default:
+            // sticky faults, fault counters and CAN status are not cached
+            break;
+        }
+    }
+
+    for (i = 0; i < STATUS_FIELDS; i++) {
+        if (updated & (1 << i)) {
+            telemetry->updated_us[i] = now;
+        }
+    }
+
+    return 0;
+}
+
+int config_encoder_lines_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint16_t lines, JaguarCompletion callback, 
+        void *context)
 {
     CANMessage message;
-    CANMessage ack;
     init_jaguar_message(&message, API_CONFIG, CONFIG_ENCODER_LINES);
     message.device = device;
     message.data_size = 2;
     message.data[0] = (uint8_t) (lines & 0x00ff);
     message.data[1] = (uint8_t) (lines >> 8);
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &ack);
 
-    return 1 - valid_ack(&message, &ack);
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_ACK, callback, 
+            context);
 }
 
-int get_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t *lines)
+int config_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t lines)
+{
+    JaguarTransaction tx;
+
+    return await_transaction(conn, &tx, 
+            config_encoder_lines_async(conn, &tx, device, lines, NULL, NULL));
+}
+
+int get_encoder_lines_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context)
 {
     CANMessage message;
-    CANMessage reply;
     init_jaguar_message(&message, API_CONFIG, CONFIG_ENCODER_LINES);
     message.device = device;
     message.data_size = 0;
-    send_can_message(conn, &message);
-    recieve_can_message(conn, &reply);
-    
-    if (valid_jaguar_reply(&message, &reply)) {
-        *lines = reply.data[0] | reply.data[1] << 8;
-        return 0;
-    } else {
-        return 1;
+
+    return submit_request(conn, tx, &message, JAGUAR_EXPECT_REPLY, callback, 
+            context);
+}
+
+int get_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t *lines)
+{
+    JaguarTransaction tx;
+    int result;
+
+    result = await_transaction(conn, &tx, 
+            get_encoder_lines_async(conn, &tx, device, NULL, NULL));
+    if (result != JAGUAR_OK) {
+        return result;
     }
+
+    return get_reply_uint16(&tx, lines);
 }
   
@@ -8,67 +8,767 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <termios.h>
 #include <unistd.h>
 
+// Return codes
+#define JAGUAR_OK           0
+#define JAGUAR_ERROR        1
+#define JAGUAR_DECODE_ERROR 2
+#define JAGUAR_TIMEOUT      3
+#define JAGUAR_BUSY         4
+#define JAGUAR_PENDING      5
+#define JAGUAR_INVALID_ID   6
+
+// Default time allowed for a device to reply, in microseconds
+#define JAGUAR_DEFAULT_TIMEOUT_US 50000
+
+// Responses a transaction waits for
+#define JAGUAR_EXPECT_REPLY 0x01
+#define JAGUAR_EXPECT_ACK   0x02
+
+// Number of device numbers on a bus
+#define JAGUAR_MAX_DEVICES 64
+
+// Number of motor control status values, one per STATUS_ api index
+#define STATUS_FIELDS 11
+
+// Maximum number of transactions in flight on one connection
+#define JAGUAR_MAX_PENDING 64
+
+// Size of the per-connection receive buffer, must be a power of two
+#define RX_BUFFER_SIZE 512
+
+// Size of the per-connection transmit ring, must be a power of two. Sends 
+// fail instead of waiting when the port falls this far behind.
+#define TX_BUFFER_SIZE 4096
+
+// The dispatch table covers system and motor controller messages with api 
+// classes below 16. Each page holds one api class of one device type and 
+// is indexed by the low 10 bits of the CAN identifier (api index, device).
+#define DISPATCH_PAGES     32
+#define DISPATCH_PAGE_SIZE 1024
+
+// How long the io thread sleeps when nothing is in flight, in microseconds
+#define JAGUAR_IO_TICK_US 100000
+
+// Devices answer an enumeration after a delay of their device number in 
+// milliseconds, so every answer is in by the end of this window
+#define JAGUAR_ENUMERATION_WINDOW_US 100000
+
+// Firmware version requests kept in flight at once during discovery
+#define JAGUAR_ENUMERATION_BATCH 16
+
+// Line rate of a connection's serial port, in bits per second
+#define JAGUAR_DEFAULT_BAUD 115200
+
+// How a waiting call reads the serial port. Polling sleeps until bytes 
+// arrive. Spinning keeps reading for spin_us first, which saves the wakeup 
+// of a reply that comes in soon at the cost of a busy core. Only spin with 
+// a core to spare, otherwise the spinning thread delays the reply.
+#define JAGUAR_READ_POLL 0
+#define JAGUAR_READ_SPIN 1
+
+// What a write does once its bytes are handed to the port. With no drain 
+// the port sends them in the background, waiting returns once they have 
+// left the adapter.
+#define JAGUAR_DRAIN_NONE 0
+#define JAGUAR_DRAIN_WAIT 1
+
+// Serial tuning profiles, see set_jaguar_serial_profile()
+#define JAGUAR_PROFILE_DEFAULT     0
+#define JAGUAR_PROFILE_LOW_LATENCY 1
+#define JAGUAR_PROFILE_SPIN        2
+#define JAGUAR_SERIAL_PROFILES     3
+
+// Most round trips one latency self-test measures
+#define JAGUAR_SELF_TEST_MAX 1024
+
+// Traffic classes of the bus scheduler, most urgent first. Safety and 
+// heartbeat frames always go out next, the other classes have a share of 
+// the line and only use more of it when it would otherwise be idle.
+#define JAGUAR_CLASS_SAFETY    0
+#define JAGUAR_CLASS_HEARTBEAT 1
+#define JAGUAR_CLASS_SETPOINT  2
+#define JAGUAR_CLASS_CONFIG    3
+#define JAGUAR_CLASS_TELEMETRY 4
+#define JAGUAR_CLASSES         5
+
+// Wire time the scheduler hands to the port ahead of the line. Frames 
+// beyond it wait in their class queue, where urgent frames overtake them.
+#define JAGUAR_SCHED_LOOKAHEAD_US 2000
+
+// Time a device takes to start answering a request, in microseconds. 
+// Transports that stay on the host charge no turnaround.
+#define JAGUAR_SCHED_TURNAROUND_US 200
+
+// Wire time a class can save up while it has nothing to send
+#define JAGUAR_SCHED_BURST_US 10000
+
+// Maximum number of connections one event loop can drive
+#define JAGUAR_LOOP_MAX_CONNECTIONS 16
+
+// Round trip latencies are kept per api class of motor controller 
+// messages, with system messages in a slot of their own
+#define JAGUAR_STATS_CLASSES 17
+#define JAGUAR_STATS_SYS     16
+
+// Latency histogram buckets. Bucket 0 counts round trips under 1us and 
+// bucket i those from 2^(i-1) up to 2^i us, the last bucket also counts 
+// everything slower.
+#define JAGUAR_LATENCY_BUCKETS 20
+
+struct JaguarConnection;
+struct JaguarLoop;
+struct JaguarTransaction;
+
+typedef void (*JaguarCallback)(struct JaguarConnection *conn, 
+        CANMessage *message, void *context);
+
+// Directions of frames passed to a tap
+#define JAGUAR_TAP_TX 0
+#define JAGUAR_TAP_RX 1
+
+// Called for every frame sent or received once set with set_jaguar_tap(), 
+// on the thread that sent or received it. Taps run on the io path and 
+// must return quickly.
+typedef void (*JaguarTap)(struct JaguarConnection *conn, int direction, 
+        CANMessage *message, void *context);
+
+// Events recorded by a trace ring, see start_jaguar_trace()
+#define JAGUAR_TRACE_TX           0
+#define JAGUAR_TRACE_RX           1
+#define JAGUAR_TRACE_START        2
+#define JAGUAR_TRACE_COMPLETE     3
+#define JAGUAR_TRACE_TIMEOUT      4
+#define JAGUAR_TRACE_DECODE_ERROR 5
+
+// Records a trace ring holds before the oldest are overwritten, a power of 
+// two
+#define JAGUAR_TRACE_RECORDS 8192
+
+// Clocks trace timestamps are read from. The TSC is used where the CPU has 
+// one, dump headers pair it with monotonic time so it can be converted.
+#define JAGUAR_TRACE_CLOCK_MONOTONIC 0
+#define JAGUAR_TRACE_CLOCK_TSC       1
+
+// One traced event. id is the CAN identifier of the frame or request. 
+// value is the data size of a frame, the expected answers of a started 
+// transaction or the round trip in microseconds of a completed one, 
+// status its result. seq is the record's position in the ring plus one 
+// and is written last, so a record being overwritten is never dumped. It 
+// is 64 bits wide so it never wraps, a 32 bit count would after about an 
+// hour of a busy bus and match a stale record again.
+typedef struct JaguarTraceRecord {
+    uint64_t time;
+    uint64_t seq;
+    uint32_t id;
+    uint32_t value;
+    uint8_t event;
+    uint8_t status;
+    uint8_t reserved[6];
+} JaguarTraceRecord;
+
+// Start of a trace dump file, followed by count records oldest first, in 
+// host byte order. start_* and dump_* pair the trace clock with monotonic 
+// nanoseconds when tracing started and when the dump was taken. Version 2 
+// widened the record seq to 64 bits.
+typedef struct JaguarTraceHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t clock;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t dumps;
+    uint64_t start_clock;
+    uint64_t start_ns;
+    uint64_t dump_clock;
+    uint64_t dump_ns;
+} JaguarTraceHeader;
+
+// Preallocated ring of trace records. Writers claim a slot with one atomic 
+// add on head and never wait. The dump file is created and mapped when 
+// tracing starts, so dumping is a copy into memory and is safe from a 
+// signal handler.
+typedef struct JaguarTrace {
+    JaguarTraceRecord records[JAGUAR_TRACE_RECORDS];
+    uint64_t head;
+    bool enabled;
+    bool dump_on_fault;
+    int dumping;
+    // Set when a transaction times out with the connection lock held, 
+    // the ring is dumped once it is released
+    int fault;
+    JaguarTraceHeader *dump;
+    size_t dump_size;
+    uint64_t start_clock;
+    uint64_t start_ns;
+} JaguarTrace;
+
+// Called once a transaction submitted with a callback completes, on the 
+// thread that completed it, usually the io thread or event loop. The 
+// transaction must stay valid until its callback has returned.
+typedef void (*JaguarCompletion)(struct JaguarConnection *conn, 
+        struct JaguarTransaction *tx, void *context);
+
+// Handlers are owned by the caller and must stay valid while registered. 
+// A handler may register and remove handlers from its callback.
+typedef struct JaguarHandler {
+    JaguarCallback callback;
+    void *context;
+} JaguarHandler;
+
+// A request and the responses it is waiting for. Transactions are owned by 
+// the caller and must stay valid until they complete.
+typedef struct JaguarTransaction {
+    CANMessage request;
+    CANMessage reply;
+    uint8_t expect;
+    int status;
+    uint64_t deadline_us;
+    uint64_t sent_us;
+
+    // Submission queue link, and on the first transaction of a unit the 
+    // number of transactions queued with it that go out in the same send
+    struct JaguarTransaction *next;
+    bool queued;
+    uint8_t unit;
+
+    // Optional completion callback, NULL to poll or wait instead
+    JaguarCompletion callback;
+    void *context;
+} JaguarTransaction;
+
+// One device's entry in a synchronous setpoint batch. value is a voltage 
+// or a position depending on the call, result is filled in per device. A 
+// negative count is JAGUAR_ERROR and an empty batch sends nothing.
+typedef struct JaguarSetpoint {
+    uint8_t device;
+    int32_t value;
+    int result;
+} JaguarSetpoint;
+
+// Last known status of a device. updated_us holds the monotonic time each 
+// value was received, indexed by its STATUS_ api index, 0 if never.
+typedef struct JaguarTelemetry {
+    int16_t output_percent;
+    uint16_t bus_voltage;
+    int16_t current;
+    uint16_t temperature;
+    int32_t position;
+    int32_t speed;
+    uint8_t limit;
+    uint8_t fault;
+    uint16_t power;
+    uint8_t mode;
+    int16_t output_volts;
+    uint64_t updated_us[STATUS_FIELDS];
+} JaguarTelemetry;
+
+// A status snapshot in engineering units, see convert_jaguar_telemetry(). 
+// Output is in percent of full scale, position in revolutions and speed in 
+// revolutions per minute. Flags and the mode are passed through as is.
+typedef struct JaguarTelemetryUnits {
+    double output_percent;
+    double bus_volts;
+    double current_amps;
+    double temperature_c;
+    double position_rev;
+    double speed_rpm;
+    double output_volts;
+    uint8_t limit;
+    uint8_t fault;
+    uint16_t power;
+    uint8_t mode;
+    uint64_t updated_us[STATUS_FIELDS];
+} JaguarTelemetryUnits;
+
+// A device found on the bus by enumerate_jaguar_devices(). firmware_version 
+// is 0 if the device did not answer the version request.
+typedef struct JaguarDeviceInfo {
+    bool present;
+    uint32_t firmware_version;
+    uint64_t seen_us;
+} JaguarDeviceInfo;
+
+// Timing of the heartbeats sent by the heartbeat scheduler. Jitter is how 
+// late a heartbeat went out compared to its schedule, in microseconds.
+typedef struct JaguarHeartbeatStats {
+    uint64_t sent;
+    uint64_t missed;
+    uint32_t last_jitter_us;
+    uint32_t max_jitter_us;
+    uint64_t total_jitter_us;
+} JaguarHeartbeatStats;
+
+// Counters are updated without locks while the connection runs and read 
+// with get_jaguar_stats(). Every field is a uint64_t counter.
+typedef struct JaguarLatency {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[JAGUAR_LATENCY_BUCKETS];
+} JaguarLatency;
+
+typedef struct JaguarDeviceStats {
+    uint64_t frames_sent;
+    uint64_t frames_received;
+    uint64_t timeouts;
+    uint64_t lost_replies;
+    JaguarLatency latency;
+} JaguarDeviceStats;
+
+typedef struct JaguarStats {
+    uint64_t frames_sent;
+    uint64_t frames_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    // Extra bytes spent escaping special bytes on the wire
+    uint64_t escape_bytes_sent;
+    uint64_t escape_bytes_received;
+    uint64_t decode_errors;
+    // Messages that matched no transaction, handler or status message
+    uint64_t invalid_replies;
+    // Acknowledgements that matched no transaction
+    uint64_t invalid_acks;
+    // Requests acknowledged without their reply
+    uint64_t lost_replies;
+    uint64_t timeouts;
+    uint64_t write_errors;
+    JaguarLatency latency[JAGUAR_STATS_CLASSES];
+    // Frames and estimated wire time sent per scheduler class
+    uint64_t class_frames_sent[JAGUAR_CLASSES];
+    uint64_t class_wire_us[JAGUAR_CLASSES];
+} JaguarStats;
+
+struct JaguarConnection;
+
+// Moves frames between a connection and the bus. The connection's 
+// serial_fd is the transport's file descriptor, polled for incoming frames 
+// whatever the transport.
+typedef struct JaguarTransport {
+    const char *name;
+    // Hand messages to the bus back to back, in as few system calls as 
+    // possible. Called with tx_lock held. Returns JAGUAR_BUSY if the bus 
+    // cannot take them yet and JAGUAR_ERROR if the transport failed.
+    int (*send)(struct JaguarConnection *conn, CANMessage *messages, 
+            int count);
+    // Read whatever is available without blocking, once parse has nothing 
+    // left. Returns the number of bytes read, 0 if there were none or -1 if 
+    // the transport failed.
+    int (*fill)(struct JaguarConnection *conn);
+    // Take the next message out of what was read, returns a PARSE_ result
+    int (*parse)(struct JaguarConnection *conn, CANMessage *message);
+    // Wait until sent frames have left the host, may be NULL
+    void (*drain)(struct JaguarConnection *conn);
+    // Release the file descriptor and transport_data
+    void (*close)(struct JaguarConnection *conn);
+    // Write bytes send left queued once the file descriptor is writable, 
+    // without blocking. Called with tx_lock held, NULL if send never 
+    // leaves bytes queued.
+    int (*flush)(struct JaguarConnection *conn);
+} JaguarTransport;
+
+// Serial port settings used by open_jaguar_connection_options(). 
+// low_latency asks the driver to push received bytes up at once instead of 
+// batching them, latency_timer_ms sets how long a USB adapter holds bytes 
+// in its FIFO before sending them to the host, 0 leaves it as it is. Both 
+// are skipped where the port does not support them.
+typedef struct JaguarSerialOptions {
+    uint32_t baud;
+    bool low_latency;
+    uint8_t latency_timer_ms;
+    uint8_t read_strategy;
+    uint32_t spin_us;
+    uint8_t tx_drain;
+} JaguarSerialOptions;
+
+// Round trips measured by measure_jaguar_latency(), in microseconds
+typedef struct JaguarLatencyReport {
+    int samples;
+    int failures;
+    uint32_t min_us;
+    uint32_t median_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+    uint32_t mean_us;
+} JaguarLatencyReport;
+
 typedef struct JaguarConnection {
     int serial_fd;
     bool is_connected;
     const char *serial_port;
+    const JaguarTransport *transport;
+    void *transport_data;
     struct termios *saved_settings;
+    JaguarSerialOptions serial_options;
+    uint32_t timeout_us;
+
+    // Receive ring buffer, bytes between rx_head and rx_tail are unparsed
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    CANFrameParser rx_parser;
+
+    // Transmit ring, bytes between tx_head and tx_tail are encoded frames 
+    // the port has not taken yet. Guarded by tx_lock.
+    uint8_t tx_buffer[TX_BUFFER_SIZE];
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    // Set while an event loop also waits for the port to be writable
+    bool tx_watched;
+
+    // Transactions in flight, in the order they were sent
+    JaguarTransaction *pending[JAGUAR_MAX_PENDING];
+    int pending_count;
+
+    // Handlers for incoming messages, indexed by CAN identifier. Frames 
+    // are dispatched without a lock: threads inside a handler are counted 
+    // per dispatch epoch, so replacing one can wait for them. The lock 
+    // only serializes registration.
+    JaguarHandler **dispatch[DISPATCH_PAGES];
+    JaguarHandler *default_handler;
+    unsigned int dispatch_epoch;
+    int dispatch_readers[2];
+    pthread_mutex_t dispatch_lock;
+
+    // Status values seen on the bus, indexed by device number
+    JaguarTelemetry telemetry[JAGUAR_MAX_DEVICES];
+
+    // Devices found by the last enumeration, indexed by device number
+    JaguarDeviceInfo devices[JAGUAR_MAX_DEVICES];
+
+    // Layout of each periodic status message configured on each device
+    uint8_t pstat_layout[JAGUAR_MAX_DEVICES][PSTAT_MESSAGES][MAX_DATA_BYTES];
+
+    // Serializes writes so frames never interleave on the port
+    pthread_mutex_t tx_lock;
+
+    // Heartbeat scheduler, heartbeat_fd is -1 while stopped. A timer 
+    // stopped while an io thread or event loop owns the connection is 
+    // closed by the owner, heartbeat_stop tells it to. Settings and stats 
+    // are guarded by lock.
+    int heartbeat_fd;
+    bool heartbeat_stop;
+    uint8_t heartbeat_device;
+    uint32_t heartbeat_period_us;
+    uint64_t heartbeat_next_us;
+    JaguarHeartbeatStats heartbeat_stats;
+
+    // Traffic counters for the whole bus and for each device
+    JaguarStats stats;
+    JaguarDeviceStats device_stats[JAGUAR_MAX_DEVICES];
+
+    // Background receive thread
+    pthread_t io_thread;
+    bool io_running;
+    volatile bool io_stop;
+    int wake_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Event loop driving this connection instead of an io thread
+    struct JaguarLoop *loop;
+
+    // Transactions submitted by any thread while an io thread or event 
+    // loop owns the port, newest first
+    JaguarTransaction *submissions;
+
+    // Completed transactions whose callbacks have yet to run
+    JaguarTransaction *completed;
+
+    // Bumped on every completion, callers waiting for a transaction sleep 
+    // on it rather than on the transaction, which may be gone as soon as 
+    // its status is stored. sleepers counts them, so nobody wakes them 
+    // for nothing.
+    int completions;
+    int sleepers;
+
+    // Frame tap and the number of threads inside it
+    JaguarTap tap;
+    void *tap_context;
+    int tap_users;
+
+    // Trace ring, NULL until tracing is first started
+    JaguarTrace *trace;
+
+    // Bus scheduler of the io owner. Transactions wait in the queue of 
+    // their class until the line has room. class_budget_us is the wire 
+    // time each class has left, class_share its percent of the line rate. 
+    // line_free_us is when the line is expected to be done with what was 
+    // handed to the port, schedule_us when to send again, 0 if nothing 
+    // is waiting. turnaround_us is the answer delay charged to each 
+    // transaction.
+    uint32_t baud;
+    uint32_t turnaround_us;
+    uint64_t line_free_us;
+    JaguarTransaction *class_head[JAGUAR_CLASSES];
+    JaguarTransaction *class_tail[JAGUAR_CLASSES];
+    int64_t class_budget_us[JAGUAR_CLASSES];
+    uint8_t class_share[JAGUAR_CLASSES];
+    uint64_t budget_updated_us;
+    uint64_t schedule_us;
 } JaguarConnection;
 
+// One thread receiving for several connections, typically one per serial 
+// adapter, multiplexed with epoll. Waiting calls on its connections sleep 
+// until the loop completes their transactions, as with an io thread. cpu 
+// pins the loop thread to one core, -1 leaves it unpinned.
+typedef struct JaguarLoop {
+    int epoll_fd;
+    int wake_fd;
+    int cpu;
+    JaguarConnection *connections[JAGUAR_LOOP_MAX_CONNECTIONS];
+    int connection_count;
+
+    // Connection the loop thread is servicing without the lock, and one a 
+    // callback removed meanwhile that the loop lets go of afterwards. idle 
+    // is signalled whenever the loop thread is done with a connection.
+    JaguarConnection *active;
+    JaguarConnection *detached;
+    pthread_cond_t idle;
+
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+    volatile bool stop;
+} JaguarLoop;
+
 int open_jaguar_connection(JaguarConnection *conn, const char *serial_port);
+int open_jaguar_connection_options(JaguarConnection *conn, 
+        const char *serial_port, const JaguarSerialOptions *options);
+int open_jaguar_transport(JaguarConnection *conn, 
+        const JaguarTransport *transport, void *data, int fd, uint32_t baud);
 int close_jaguar_connection(JaguarConnection *conn);
+int set_jaguar_timeout(JaguarConnection *conn, uint32_t timeout_us);
+
+int init_jaguar_serial_options(JaguarSerialOptions *options);
+int set_jaguar_serial_profile(JaguarSerialOptions *options, int profile);
+int measure_jaguar_latency(JaguarConnection *conn, uint8_t device, 
+        int count, JaguarLatencyReport *report);
+int compare_jaguar_serial_profiles(const char *serial_port, uint32_t baud, 
+        uint8_t device, int count, 
+        JaguarLatencyReport reports[JAGUAR_SERIAL_PROFILES]);
+
+uint64_t jaguar_time_us(void);
 
 int send_can_message(JaguarConnection *conn, CANMessage *message);
+int send_can_messages(JaguarConnection *conn, CANMessage *messages, int count);
 int recieve_can_message(JaguarConnection *conn, CANMessage *message);
+int recieve_can_message_deadline(JaguarConnection *conn, CANMessage *message,
+        uint64_t deadline_us);
+int recieve_can_messages(JaguarConnection *conn, CANMessage *messages, 
+        int max_messages, int *decode_errors);
 
 int init_sys_message(CANMessage *message, uint8_t api_index);
 int init_jaguar_message(CANMessage *message, uint8_t api_class, uint8_t api_index);
 
+int get_jaguar_class(CANMessage *message);
+uint32_t estimate_wire_time_us(JaguarConnection *conn, CANMessage *message);
+int set_jaguar_class_share(JaguarConnection *conn, int traffic_class, 
+        uint8_t percent);
+
 bool valid_sys_reply(CANMessage *message, CANMessage *reply);
 bool valid_jaguar_reply(CANMessage *message, CANMessage *reply);
 bool valid_ack(CANMessage *message, CANMessage *ack);
 
+int init_jaguar_transaction(JaguarTransaction *tx, CANMessage *message, 
+        uint8_t expect);
+int submit_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx);
+int wait_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx);
+int wait_jaguar_transactions(JaguarConnection *conn, JaguarTransaction *txs,
+        int count);
+int poll_jaguar_transaction(JaguarConnection *conn, JaguarTransaction *tx);
+
+int get_reply_uint8(JaguarTransaction *tx, uint8_t *value);
+int get_reply_int16(JaguarTransaction *tx, int16_t *value);
+int get_reply_uint16(JaguarTransaction *tx, uint16_t *value);
+int get_reply_int32(JaguarTransaction *tx, int32_t *value);
+int get_reply_uint32(JaguarTransaction *tx, uint32_t *value);
+int process_jaguar_messages(JaguarConnection *conn, uint64_t deadline_us);
+int poll_jaguar_messages(JaguarConnection *conn);
+
+int register_jaguar_handler(JaguarConnection *conn, uint32_t id, 
+        JaguarHandler *handler);
+int set_default_jaguar_handler(JaguarConnection *conn, JaguarHandler *handler);
+int set_jaguar_tap(JaguarConnection *conn, JaguarTap tap, void *context);
+int inject_jaguar_message(JaguarConnection *conn, CANMessage *message);
+int start_jaguar_trace(JaguarConnection *conn, const char *dump_path, 
+        bool dump_on_fault);
+int stop_jaguar_trace(JaguarConnection *conn);
+int dump_jaguar_trace(JaguarConnection *conn);
+int wait_jaguar_message(JaguarConnection *conn, uint32_t id, 
+        CANMessage *message, uint64_t deadline_us);
+
+int start_jaguar_io_thread(JaguarConnection *conn);
+int stop_jaguar_io_thread(JaguarConnection *conn);
+
+int open_jaguar_loop(JaguarLoop *loop, int cpu);
+int close_jaguar_loop(JaguarLoop *loop);
+// Callbacks and handlers of a connection on a loop run on the loop thread 
+// without the loop lock, so they may add or remove connections, their own 
+// included, and close others. Their own connection is let go of once they 
+// return and must not be closed by them.
+int add_jaguar_loop_connection(JaguarLoop *loop, JaguarConnection *conn);
+int remove_jaguar_loop_connection(JaguarLoop *loop, JaguarConnection *conn);
+int start_jaguar_loop(JaguarLoop *loop);
+int stop_jaguar_loop(JaguarLoop *loop);
+
+int get_jaguar_stats(JaguarConnection *conn, JaguarStats *stats);
+int get_jaguar_device_stats(JaguarConnection *conn, uint8_t device, 
+        JaguarDeviceStats *stats);
+int reset_jaguar_stats(JaguarConnection *conn);
+
 int sys_heartbeat(JaguarConnection *conn, uint8_t device);
+int sys_heartbeat_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int sys_halt(JaguarConnection *conn, uint8_t device);
+int sys_halt_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int sys_reset(JaguarConnection *conn, uint8_t device);
+int sys_reset_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int sys_resume(JaguarConnection *conn, uint8_t device);
+int sys_resume_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int sys_sync_update(JaguarConnection *conn, uint8_t group);
+int sys_sync_update_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t group, JaguarCompletion callback, void *context);
+int sys_enumerate(JaguarConnection *conn);
+int sys_enumerate_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        JaguarCompletion callback, void *context);
+int sys_firmware_version(JaguarConnection *conn, uint8_t device, 
+        uint32_t *version);
+int sys_firmware_version_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
+
+int enumerate_jaguar_devices(JaguarConnection *conn, uint32_t window_us, 
+        JaguarDeviceInfo *devices, int *count);
+
+int start_jaguar_heartbeat(JaguarConnection *conn, uint8_t device, 
+        uint32_t period_us);
+int stop_jaguar_heartbeat(JaguarConnection *conn);
+int service_jaguar_heartbeat(JaguarConnection *conn);
+int get_jaguar_heartbeat_stats(JaguarConnection *conn, 
+        JaguarHeartbeatStats *stats);
 
 int voltage_enable(JaguarConnection *conn, uint8_t device);
+int voltage_enable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int voltage_disable(JaguarConnection *conn, uint8_t device);
+int voltage_disable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int voltage_set(JaguarConnection *conn, uint8_t device, int16_t voltage);
+int voltage_set_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int16_t voltage, JaguarCompletion callback, 
+        void *context);
 int voltage_set_sync(JaguarConnection *conn, uint8_t device, int16_t voltage, 
         uint8_t group);
+int voltage_set_sync_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int16_t voltage, uint8_t group, 
+        JaguarCompletion callback, void *context);
+int voltage_set_sync_batch(JaguarConnection *conn, JaguarSetpoint *setpoints,
+        int count, uint8_t group);
 int voltage_get(JaguarConnection *conn, uint8_t device, int16_t *voltage);
+int voltage_get_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int voltage_ramp(JaguarConnection *conn, uint8_t device, uint16_t ramp);
+int voltage_ramp_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint16_t ramp, JaguarCompletion callback, 
+        void *context);
 
 int position_enable(JaguarConnection *conn, uint8_t device, 
         int32_t position);
+int position_enable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, JaguarCompletion callback, 
+        void *context);
 int position_disable(JaguarConnection *conn, uint8_t device);
+int position_disable_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int position_set(JaguarConnection *conn, uint8_t device, 
         int32_t position);
+int position_set_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, JaguarCompletion callback, 
+        void *context);
 int position_set_sync(JaguarConnection *conn, uint8_t device, int32_t position,
         uint8_t group);
+int position_set_sync_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t position, uint8_t group, 
+        JaguarCompletion callback, void *context);
+int position_set_sync_batch(JaguarConnection *conn, JaguarSetpoint *setpoints,
+        int count, uint8_t group);
 int position_get(JaguarConnection *conn, uint8_t device, int32_t *position);
+int position_get_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int position_p(JaguarConnection *conn, uint8_t device, int32_t p);
+int position_p_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t p, JaguarCompletion callback, void *context);
 int position_i(JaguarConnection *conn, uint8_t device, int32_t i);
+int position_i_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t i, JaguarCompletion callback, void *context);
 int position_d(JaguarConnection *conn, uint8_t device, int32_t d);
+int position_d_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, int32_t d, JaguarCompletion callback, void *context);
 int position_pid(JaguarConnection *conn, uint8_t device, int32_t p, int32_t i, 
         int32_t d);
+int position_pid_async(JaguarConnection *conn, JaguarTransaction *txs, 
+        uint8_t device, int32_t p, int32_t i, int32_t d, 
+        JaguarCompletion callback, void *context);
 int position_ref_encoder(JaguarConnection *conn, uint8_t device);
+int position_ref_encoder_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 
 int status_output_percent(JaguarConnection *conn, uint8_t device, 
         int16_t *output_percent);
+int status_output_percent_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int status_temperature(JaguarConnection *conn, uint8_t device, 
         uint16_t *temperature);
+int status_temperature_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int status_position(JaguarConnection *conn, uint8_t device, uint32_t *position);
+int status_position_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 int status_mode(JaguarConnection *conn, uint8_t device, uint8_t *mode);
+int status_mode_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
+
+int get_jaguar_telemetry(JaguarConnection *conn, uint8_t device, 
+        uint8_t status_index, uint32_t max_age_us, JaguarTelemetry *telemetry);
+int status_output_percent_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, int16_t *output_percent);
+int status_temperature_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint16_t *temperature);
+int status_position_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint32_t *position);
+int status_mode_cached(JaguarConnection *conn, uint8_t device, 
+        uint32_t max_age_us, uint8_t *mode);
+int convert_jaguar_telemetry(const JaguarTelemetry *telemetry, 
+        JaguarTelemetryUnits *units);
+int get_jaguar_telemetry_units(JaguarConnection *conn, 
+        const uint8_t *devices, int count, JaguarTelemetryUnits *units);
+
+int pstat_config(JaguarConnection *conn, uint8_t device, uint8_t index, 
+        const uint8_t *layout);
+int pstat_config_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint8_t index, const uint8_t *layout, 
+        JaguarCompletion callback, void *context);
+int pstat_period(JaguarConnection *conn, uint8_t device, uint8_t index, 
+        uint16_t period_ms);
+int pstat_period_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint8_t index, uint16_t period_ms, 
+        JaguarCompletion callback, void *context);
+int decode_periodic_status(const uint8_t *layout, CANMessage *message, 
+        JaguarTelemetry *telemetry, uint64_t now);
 
 int config_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t lines);
+int config_encoder_lines_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, uint16_t lines, JaguarCompletion callback, 
+        void *context);
 int get_encoder_lines(JaguarConnection *conn, uint8_t device, uint16_t *lines);
+int get_encoder_lines_async(JaguarConnection *conn, JaguarTransaction *tx, 
+        uint8_t device, JaguarCompletion callback, void *context);
 
 #endif